@@ -0,0 +1,236 @@
+#ifndef __ADLINK_H__
+#define __ADLINK_H__
+/* 
+ * Driver for dual-port isolated CAN interface card
+ * Copyright (C) 2011  Peter Kotvan <peter.kotvan@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * adlink specific extensions to the pcan ioctl interface,
+ * shared between the driver and user space
+ */
+#include <linux/types.h>
+#include <pcan.h>
+
+/* keep clear of the request numbers used by pcan.h */
+#define ADLINK_SEQ_START (MYSEQ_START + 0x40)
+
+/* modes of operation, given in TPCANInit.ucListenOnly */
+#define PCAN_INIT_LISTEN_ONLY       0x01        /* receive only, no acknowledge */
+#define PCAN_INIT_SELF_TEST         0x02        /* a frame sent needs no acknowledge by another node */
+#define PCAN_INIT_SELF_RECEPTION    0x04        /* frames sent are received at the same time */
+#define PCAN_INIT_ERROR_REPORTS     0x08        /* bus errors and lost arbitrations make status messages */
+
+/* status messages carry the SocketCAN error class (CAN_ERR_...) in ID and its payload in DATA,
+ * only DATA[3] keeps the PCAN status; the protocol violation location moves to DATA[5] */
+
+/* a received message with 64 bit timestamps */
+typedef struct
+{
+    TPCANMsg Msg;
+    __u64 qwTimestamp;          /* rtdm_clock_read() in nsec at entry of the receiving interrupt */
+    __u64 qwSofTimestamp;       /* start of frame in nsec, reconstructed from bit timing and frame length */
+} TPCANRdMsgNs;
+
+/* several received messages, taken out of the read fifo at once */
+#define PCAN_READ_BATCH 16
+typedef struct
+{
+    __u32 dwCount;              /* in: messages wanted at most, out: messages returned */
+    TPCANRdMsgNs Msgs[PCAN_READ_BATCH];
+} TPCANRdMsgsNs;
+
+/* transmit priority classes, a class is only served while all more urgent ones are empty */
+#define PCAN_TX_URGENT  0       /* may abort a less urgent frame waiting in the transmit buffer */
+#define PCAN_TX_NORMAL  1       /* the class of PCAN_WRITE_MSG */
+#define PCAN_TX_BULK    2
+#define PCAN_TX_CLASSES 3
+
+/* a message to send, with transmit options; a frame waiting for its launch time
+ * holds back the frames queued behind it in its class */
+typedef struct
+{
+    TPCANMsg Msg;
+    __u8 ucClass;               /* PCAN_TX_URGENT, PCAN_TX_NORMAL or PCAN_TX_BULK */
+    __u8 ucFlags;               /* PCAN_WR_... */
+    __u32 dwTag;                /* handed back with the echo of the frame */
+    __u64 qwLaunchTime;         /* rtdm_clock_read() in nsec to start the transmission at, 0 for now */
+    __u64 qwDeadline;           /* rtdm_clock_read() in nsec after which the frame is dropped unsent, 0 for never */
+} TPCANWrMsg;
+
+/* replace the contents of a frame of the same ID and class not sent yet instead of queueing another one,
+ * it keeps its place in the queue and its launch time */
+#define PCAN_WR_LATEST          0x01
+/* put an error frame with CAN_ERR_TX_TIMEOUT into the read queue if the frame passes its deadline */
+#define PCAN_WR_REPORT_EXPIRY   0x02
+/* send the frame once only, no retransmission after lost arbitration or an error; the outcome is
+ * reported through PCAN_READ_TX_REPORT */
+#define PCAN_WR_SINGLE_SHOT     0x04
+/* hand the frame back to the writing path once it is sent, see PCAN_READ_ECHO */
+#define PCAN_WR_ECHO            0x08
+
+/* a frame sent, as handed back to the path which wrote it */
+typedef struct
+{
+    TPCANMsg Msg;
+    __u32 dwTag;                /* as given with the write */
+    __u64 qwTimestamp;          /* rtdm_clock_read() in nsec at the transmit interrupt */
+} TPCANEcho;
+
+/* outcome of a transmission */
+#define PCAN_TXR_DONE           0       /* the frame was sent */
+#define PCAN_TXR_ARBIT_LOST     1       /* arbitration was lost at bit ucArbitBit */
+#define PCAN_TXR_BUS_ERROR      2       /* a bus error, ucErrorCode as captured by the chip */
+#define PCAN_TXR_NOT_SENT       3       /* not sent, the cause was not captured */
+
+typedef struct
+{
+    __u64 qwTimestamp;          /* rtdm_clock_read() in nsec when the outcome was known */
+    __u32 dwID;                 /* the frame */
+    __u8 ucMsgType;             /* MSGTYPE_... of the frame */
+    __u8 ucResult;              /* PCAN_TXR_... */
+    __u8 ucArbitBit;            /* ARBIT_LOST_CAPTURE, the bit position arbitration was lost at */
+    __u8 ucErrorCode;           /* ERROR_CODE_CAPTURE, kind and position of the bus error */
+} TPTXREPORT;
+
+/* transmit rate shaping, a frame is subject to the first enabled shaper matching it */
+#define PCAN_TX_SHAPERS   4
+#define PCAN_SHAPE_FRAMES 0     /* dwRate in frames/s, dwBurst in frames */
+#define PCAN_SHAPE_BITS   1     /* dwRate in bit/s, dwBurst in bits, frames cost their estimated length */
+#define PCAN_SHAPE_ANY_ID 0     /* the identifier range applies to standard and extended frames */
+#define PCAN_SHAPE_STD_ID 1     /* standard frames only */
+#define PCAN_SHAPE_EXT_ID 2     /* extended frames only */
+
+typedef struct
+{
+    __u8 ucIndex;               /* the shaper to set, 0 .. PCAN_TX_SHAPERS - 1 */
+    __u8 ucClass;               /* the class shaped, PCAN_TX_CLASSES for all */
+    __u8 ucUnit;                /* PCAN_SHAPE_FRAMES or PCAN_SHAPE_BITS */
+    __u8 ucIdType;              /* PCAN_SHAPE_ANY_ID, PCAN_SHAPE_STD_ID or PCAN_SHAPE_EXT_ID */
+    __u32 dwFromID;             /* first identifier shaped */
+    __u32 dwToID;               /* last identifier shaped */
+    __u32 dwRate;               /* sustained rate up to 1000000000, 0 disables the shaper */
+    __u32 dwBurst;              /* size of the token bucket */
+} TPSHAPER;
+
+/* frames sent periodically by the driver itself */
+#define PCAN_TX_CYCLIC          16
+#define PCAN_CYCLIC_KEEP_TIMING 0x01    /* only replace the contents of a running job */
+
+typedef struct
+{
+    TPCANMsg Msg;
+    __u8 ucIndex;               /* the job to set, 0 .. PCAN_TX_CYCLIC - 1 */
+    __u8 ucClass;               /* transmit class of the frames */
+    __u8 ucFlags;               /* PCAN_CYCLIC_... */
+    __u32 dwCount;              /* transmissions to do, 0 for endless */
+    __u32 dwPeriodUs;           /* period in usec, 0 removes the job */
+    __u32 dwPhaseUs;            /* offset in usec of the transmissions to multiples of the period */
+} TPCYCLIC;
+
+/* frames sent at fixed offsets from the reception of a reference frame */
+#define PCAN_TX_SLOTS           16
+
+typedef struct
+{
+    __u32 dwID;                 /* the reference frame */
+    __u8 ucMsgType;             /* MSGTYPE_STANDARD or MSGTYPE_EXTENDED */
+    __u8 ucActive;              /* 0 stops the transmit matrix */
+} TPTXREF;
+
+typedef struct
+{
+    TPCANMsg Msg;
+    __u8 ucIndex;               /* the slot to set, 0 .. PCAN_TX_SLOTS - 1 */
+    __u8 ucClass;               /* transmit class of the frame */
+    __u8 ucActive;              /* 0 removes the slot */
+    __u32 dwOffsetUs;           /* launch time in usec after the start of the reference frame */
+} TPTXSLOT;
+
+/* channel statistics not covered by TPDIAG */
+typedef struct
+{
+    __u32 dwResetSwitchNs;      /* duration of the last switch into reset mode */
+    __u32 dwResetSwitchMaxNs;   /* longest switch into reset mode */
+    __u32 dwNormalSwitchNs;     /* duration of the last switch back into operating mode */
+    __u32 dwNormalSwitchMaxNs;  /* longest switch back into operating mode */
+    __u32 dwSwitchTimeouts;     /* mode switches which did not complete in time */
+    __u32 dwReconfigResetNs;    /* time the last PCAN_INIT kept the chip in reset mode */
+    __u32 dwReconfigResetMaxNs; /* longest time a PCAN_INIT kept the chip in reset mode */
+    __u32 dwIrqHandled;         /* interrupts raised by this channel */
+    __u32 dwIrqForeign;         /* interrupts on the shared line raised by others while enabled */
+    __u32 dwStageOverruns;      /* interrupts lost because the service task fell behind */
+    __u32 dwTxRequests;         /* transmissions requested at the chip */
+    __u32 dwTxDirect;           /* of these, frames written straight by the write ioctl */
+    __u32 dwTxLatencyAvgNs;     /* mean time from the write ioctl to the transmission request */
+    __u32 dwTxLatencyMaxNs;     /* longest time from the write ioctl to the transmission request */
+    __u32 dwTxAborts;           /* frames taken back out of the transmit buffer for more urgent ones */
+    __u32 dwTxShaped;           /* times the transmitter was left idle to keep a rate or a launch time */
+    __u32 dwTxCyclicLost;       /* cyclic frames dropped for a full transmit queue */
+    __u32 dwTxReferences;       /* reference frames received while the transmit matrix was active */
+    __u32 dwTxSlotLost;         /* slot frames dropped for a full transmit queue */
+    __u32 dwTxCollapsed;        /* frames replaced by a newer one of the same ID before being sent */
+    __u32 dwTxExpired;          /* frames dropped unsent past their deadline */
+    __u32 dwTxExpiredPath;      /* the part of dwTxExpired written through the asking path */
+    __u32 dwTxSingleShotFailed; /* single shot frames not sent */
+    __u32 dwTxReportsLost;      /* transmit reports dropped for a full report queue */
+    __u32 dwTxEchoLostPath;     /* echoes dropped for the full echo queue of the asking path */
+    __u32 dwTxStallRecoveries;  /* times the transmit watchdog found the transmitter stalled and kicked it */
+    __u32 dwIsrAvgNs;           /* time spent in the interrupt handler of the channel */
+    __u32 dwIsrMaxNs;
+    __u32 dwIsrCount;           /* runs of the interrupt handler which found work */
+    __u32 dwBitErrors;          /* bus errors by the type captured by the chip */
+    __u32 dwFormErrors;
+    __u32 dwStuffErrors;
+    __u32 dwOtherErrors;
+    __u32 dwAckErrors;          /* of all types, bus errors in the acknowledge slot or delimiter */
+    __u32 dwCrcErrors;          /* of all types, bus errors in the CRC sequence or delimiter */
+    __u32 dwTxBusErrors;        /* bus errors while transmitting, the others occurred while receiving */
+    __u32 dwArbitLost;          /* lost arbitrations, seen with PCAN_INIT_ERROR_REPORTS only */
+    __u32 dwRxErrorCounter;     /* receive error counter of the chip at the time of the request */
+    __u32 dwTxErrorCounter;     /* transmit error counter of the chip at the time of the request */
+    __u32 dwReserved;           /* keeps the next field 8 byte aligned for 32 and 64 bit callers */
+    __u64 qwIsrTotalNs;         /* time spent in the runs of dwIsrCount, for a mean over an interval */
+} TPCHANSTATS;
+
+/* usage of one driver lock */
+typedef struct
+{
+    __u32 dwAcquired;           /* times the lock was taken */
+    __u32 dwContended;          /* times the lock had to be waited for */
+    __u32 dwHoldMaxNs;          /* longest hold time in nsec */
+    __u64 qwHoldTotalNs;        /* sum of all hold times in nsec */
+} TPLOCKSTAT;
+
+/* usage of the locks of one channel */
+typedef struct
+{
+    TPLOCKSTAT Chip;            /* chip access, the only lock taken by the interrupt handler */
+    TPLOCKSTAT Rx;              /* readers of the receive queue */
+} TPLOCKSTATS;
+
+#define PCAN_READ_MSG_NS    _IOR(PCAN_MAGIC_NUMBER, ADLINK_SEQ_START, TPCANRdMsgNs)
+#define PCAN_GET_CHAN_STATS _IOR(PCAN_MAGIC_NUMBER, ADLINK_SEQ_START + 1, TPCHANSTATS)
+#define PCAN_GET_LOCK_STATS _IOR(PCAN_MAGIC_NUMBER, ADLINK_SEQ_START + 2, TPLOCKSTATS)
+#define PCAN_READ_MSGS_NS   _IOWR(PCAN_MAGIC_NUMBER, ADLINK_SEQ_START + 3, TPCANRdMsgsNs)
+#define PCAN_WRITE_MSG_EX   _IOW(PCAN_MAGIC_NUMBER, ADLINK_SEQ_START + 4, TPCANWrMsg)
+#define PCAN_SET_SHAPER     _IOW(PCAN_MAGIC_NUMBER, ADLINK_SEQ_START + 5, TPSHAPER)
+#define PCAN_SET_CYCLIC     _IOW(PCAN_MAGIC_NUMBER, ADLINK_SEQ_START + 6, TPCYCLIC)
+#define PCAN_SET_TX_REFERENCE _IOW(PCAN_MAGIC_NUMBER, ADLINK_SEQ_START + 7, TPTXREF)
+#define PCAN_SET_TX_SLOT    _IOW(PCAN_MAGIC_NUMBER, ADLINK_SEQ_START + 8, TPTXSLOT)
+#define PCAN_READ_TX_REPORT _IOR(PCAN_MAGIC_NUMBER, ADLINK_SEQ_START + 9, TPTXREPORT)
+#define PCAN_READ_ECHO      _IOR(PCAN_MAGIC_NUMBER, ADLINK_SEQ_START + 10, TPCANEcho)
+
+#endif /* __ADLINK_H__ */
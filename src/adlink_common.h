@@ -57,21 +57,65 @@
 #include <rtdm/rtdm_driver.h>
 #include <asm/div64.h>
 #if RTDM_API_VER < 5
-typedef nanosecs_abs_t uint64_t;
+typedef uint64_t nanosecs_abs_t;
 #endif
 
+#define PCAN_IRQ_RETVAL(x) x
+
+/**
+ * a rtdm lock which keeps track of its contention and hold times
+ */
+typedef struct
+{
+    rtdm_lock_t lock;
+    atomic_t nUsers;            /* the holder and all waiters */
+    nanosecs_abs_t qwTaken;     /* when the current holder got the lock */
+    u32 dwAcquired;             /* times the lock was taken */
+    u32 dwContended;            /* times the lock had to be waited for */
+    u32 dwHoldMaxNs;            /* longest hold time */
+    u64 qwHoldTotalNs;          /* sum of all hold times */
+} PCAN_LOCK;
+
+static inline void
+pcan_lock_init (PCAN_LOCK * l)
+{
+    rtdm_lock_init (&l->lock);
+    atomic_set (&l->nUsers, 0);
+    l->dwAcquired = 0;
+    l->dwContended = 0;
+    l->dwHoldMaxNs = 0;
+    l->qwHoldTotalNs = 0;
+}
+
 static inline void
-rt_gettimeofday (struct timeval *tv)
+pcan_lock_get_irqsave (PCAN_LOCK * l, rtdm_lockctx_t * context)
 {
-    nanosecs_abs_t current_time = rtdm_clock_read ();
-    tv->tv_usec = (do_div (current_time, 1000000000) / 1000);
-    tv->tv_sec = current_time;
+    int contended;
 
+    /* interrupts off first, so an interrupt handler does not count as a waiter */
+    rtdm_lock_irqsave (*context);
+    contended = (atomic_inc_return (&l->nUsers) > 1);
+    rtdm_lock_get (&l->lock);
+
+    l->qwTaken = rtdm_clock_read ();
+    l->dwAcquired++;
+    if (contended)
+        l->dwContended++;
 }
 
-#define DO_GETTIMEOFDAY(tv) rt_gettimeofday(&tv)
+static inline void
+pcan_lock_put_irqrestore (PCAN_LOCK * l, rtdm_lockctx_t * context)
+{
+    u32 dwHold = (u32) (rtdm_clock_read () - l->qwTaken);
+
+    l->qwHoldTotalNs += dwHold;
+    if (dwHold > l->dwHoldMaxNs)
+        l->dwHoldMaxNs = dwHold;
 
-#define PCAN_IRQ_RETVAL(x) x
+    rtdm_lock_put (&l->lock);
+    atomic_dec (&l->nUsers);
+    rtdm_lock_irqrestore (*context);
+}
 
 #define INIT_LOCK(lock)
 #define DECLARE_SPIN_LOCK_IRQSAVE_FLAGS
@@ -0,0 +1,285 @@
+/* 
+ * Driver for dual-port isolated CAN interface card
+ * Copyright (C) 2011  Peter Kotvan <peter.kotvan@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Cyclic transmission of frames, serviced by one timer per channel, and
+ * time triggered transmission synchronized to a reference frame
+ */
+
+#include <adlink_common.h>
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/errno.h>        /* error codes */
+#include <asm/div64.h>          /* do_div() */
+
+#include <adlink_txq.h>
+#include <adlink_cyclic.h>
+
+/*
+ * The jobs are guarded by cyclic_lock, which is held only to copy a frame
+ * in or out, so a frame is always sent either with its old or its new
+ * contents. The frames are put into the transmit queue of their class like
+ * the ones of any other writer.
+ */
+
+/* the first time at or after now which is a multiple of the period plus the phase */
+static nanosecs_abs_t
+pcan_cyclic_start (nanosecs_abs_t now, u32 dwPeriodUs, u32 dwPhaseUs)
+{
+    u64 periods = now;
+    nanosecs_abs_t next;
+
+    do_div (periods, 1000);
+    do_div (periods, dwPeriodUs);
+
+    next = (periods * dwPeriodUs + dwPhaseUs) * 1000;
+    while (next <= now)
+        next += (nanosecs_abs_t) dwPeriodUs * 1000;
+
+    return next;
+}
+
+/* stop all jobs and the transmit matrix */
+void
+pcan_cyclic_reset (struct pcandev *dev)
+{
+    rtdm_lockctx_t lockctx;
+
+    rtdm_lock_get_irqsave (&dev->cyclic_lock, lockctx);
+    dev->ucRefActive = 0;
+    memset (dev->txCyclic, 0, sizeof (dev->txCyclic));
+    memset (dev->txSlot, 0, sizeof (dev->txSlot));
+    dev->ucSlots = 0;
+    rtdm_lock_put_irqrestore (&dev->cyclic_lock, lockctx);
+}
+
+/* add, change or remove a job */
+int
+pcan_cyclic_set (struct pcandev *dev, TPCYCLIC * job)
+{
+    TX_CYCLIC *c;
+    struct can_frame cf;
+    TX_IMAGE img;
+    nanosecs_abs_t next = 0;
+    rtdm_lockctx_t lockctx;
+
+    if (job->ucIndex >= PCAN_TX_CYCLIC || job->ucClass >= PCAN_TX_CLASSES)
+        return -EINVAL;
+
+    if (job->dwPeriodUs && job->dwPhaseUs >= job->dwPeriodUs)
+        return -EINVAL;
+
+    /* filter extended data if initialized to standard only */
+    if (!(dev->bExtended) && ((job->Msg.MSGTYPE & MSGTYPE_EXTENDED) || (job->Msg.ID > 2047)))
+        return -EINVAL;
+
+    /* prepare everything outside of the lock */
+    msg2frame (&cf, &job->Msg);
+    dev->device_marshal (&cf, &img);
+    img.ucClass = job->ucClass;
+    img.qwLaunch = 0;
+    img.qwDeadline = 0;
+    img.wCtxId = 0;
+    img.dwTag = 0;
+    img.ucFlags = 0;
+
+    if (job->dwPeriodUs && !(job->ucFlags & PCAN_CYCLIC_KEEP_TIMING))
+        next = pcan_cyclic_start (rtdm_clock_read (), job->dwPeriodUs, job->dwPhaseUs);
+
+    c = &dev->txCyclic[job->ucIndex];
+
+    rtdm_lock_get_irqsave (&dev->cyclic_lock, lockctx);
+    c->img = img;
+    if (!job->dwPeriodUs)
+        c->qwPeriod = 0;
+    else if (!(job->ucFlags & PCAN_CYCLIC_KEEP_TIMING) || !c->qwPeriod)
+    {
+        c->qwPeriod = (nanosecs_abs_t) job->dwPeriodUs * 1000;
+        c->qwNext = (next) ? next : pcan_cyclic_start (rtdm_clock_read (), job->dwPeriodUs,
+                                                       job->dwPhaseUs);
+        c->dwCount = job->dwCount;
+    }
+    rtdm_lock_put_irqrestore (&dev->cyclic_lock, lockctx);
+
+    return 0;
+}
+
+/* queue the frames of all jobs due, returns the time the next job gets due or 0 if none is left */
+nanosecs_abs_t
+pcan_cyclic_fire (struct pcandev *dev, nanosecs_abs_t now)
+{
+    TX_CYCLIC *c;
+    TX_IMAGE img;
+    nanosecs_abs_t next = 0;
+    rtdm_lockctx_t lockctx;
+    int i;
+
+    for (i = 0; i < PCAN_TX_CYCLIC; i++)
+    {
+        c = &dev->txCyclic[i];
+
+        rtdm_lock_get_irqsave (&dev->cyclic_lock, lockctx);
+
+        if (c->qwPeriod && c->qwNext <= now)
+        {
+            img = c->img;
+
+            /* a period missed entirely is not made up for */
+            do
+                c->qwNext += c->qwPeriod;
+            while (c->qwNext <= now);
+
+            if (c->dwCount && !--c->dwCount)
+                c->qwPeriod = 0;
+
+            rtdm_lock_put_irqrestore (&dev->cyclic_lock, lockctx);
+
+            img.qwQueued = now;
+            if (pcan_txq_put (&dev->txq[img.ucClass], &img))
+                dev->dwTxCyclicLost++;
+
+            rtdm_lock_get_irqsave (&dev->cyclic_lock, lockctx);
+        }
+
+        if (c->qwPeriod && (!next || c->qwNext < next))
+            next = c->qwNext;
+
+        rtdm_lock_put_irqrestore (&dev->cyclic_lock, lockctx);
+    }
+
+    return next;
+}
+
+/*
+ * The transmit matrix is started by each reception of the reference frame:
+ * every slot is queued with a launch time at its offset from the start of
+ * the reference frame, so the transmitter holds it back until then. Slots
+ * of the same class are queued by offset as a queue is served in order.
+ */
+
+/* change the reference frame, received frames are compared with it under cyclic_lock */
+int
+pcan_matrix_set_reference (struct pcandev *dev, TPTXREF * ref)
+{
+    struct can_frame cf;
+    TPCANMsg msg;
+    TX_IMAGE img;
+    rtdm_lockctx_t lockctx;
+
+    /* filter extended data if initialized to standard only */
+    if (!(dev->bExtended) && ((ref->ucMsgType & MSGTYPE_EXTENDED) || (ref->dwID > 2047)))
+        return -EINVAL;
+
+    memset (&msg, 0, sizeof (msg));
+    msg.ID = ref->dwID;
+    msg.MSGTYPE = ref->ucMsgType & MSGTYPE_EXTENDED;
+    msg2frame (&cf, &msg);
+    dev->device_marshal (&cf, &img);
+
+    /* the identifier and the enable change together */
+    rtdm_lock_get_irqsave (&dev->cyclic_lock, lockctx);
+    dev->txRef = img;
+    dev->ucRefActive = ref->ucActive ? 1 : 0;
+    rtdm_lock_put_irqrestore (&dev->cyclic_lock, lockctx);
+
+    return 0;
+}
+
+/* add, change or remove a slot */
+int
+pcan_matrix_set_slot (struct pcandev *dev, TPTXSLOT * slot)
+{
+    TX_SLOT *s;
+    struct can_frame cf;
+    TX_IMAGE img;
+    rtdm_lockctx_t lockctx;
+    int i, j;
+
+    if (slot->ucIndex >= PCAN_TX_SLOTS || slot->ucClass >= PCAN_TX_CLASSES)
+        return -EINVAL;
+
+    /* filter extended data if initialized to standard only */
+    if (!(dev->bExtended) && ((slot->Msg.MSGTYPE & MSGTYPE_EXTENDED) || (slot->Msg.ID > 2047)))
+        return -EINVAL;
+
+    msg2frame (&cf, &slot->Msg);
+    dev->device_marshal (&cf, &img);
+    img.ucClass = slot->ucClass;
+    img.qwDeadline = 0;
+    img.wCtxId = 0;
+    img.dwTag = 0;
+    img.ucFlags = 0;
+
+    s = &dev->txSlot[slot->ucIndex];
+
+    rtdm_lock_get_irqsave (&dev->cyclic_lock, lockctx);
+
+    s->img = img;
+    s->qwOffset = (nanosecs_abs_t) slot->dwOffsetUs * 1000;
+    s->ucActive = slot->ucActive;
+
+    /* sort the active slots by offset, there are only a few */
+    dev->ucSlots = 0;
+    for (i = 0; i < PCAN_TX_SLOTS; i++)
+    {
+        if (!dev->txSlot[i].ucActive)
+            continue;
+
+        for (j = dev->ucSlots; j > 0 && dev->txSlot[dev->ucSlotOrder[j - 1]].qwOffset > dev->txSlot[i].qwOffset; j--)
+            dev->ucSlotOrder[j] = dev->ucSlotOrder[j - 1];
+        dev->ucSlotOrder[j] = i;
+        dev->ucSlots++;
+    }
+
+    rtdm_lock_put_irqrestore (&dev->cyclic_lock, lockctx);
+
+    return 0;
+}
+
+/* queue all slots after a reference frame started at qwSof, returns the count of frames queued */
+int
+pcan_matrix_trigger (struct pcandev *dev, nanosecs_abs_t qwSof)
+{
+    TX_SLOT *s;
+    TX_IMAGE img;
+    nanosecs_abs_t now = rtdm_clock_read ();
+    rtdm_lockctx_t lockctx;
+    int queued = 0;
+    int i;
+
+    dev->dwTxReferences++;
+
+    rtdm_lock_get_irqsave (&dev->cyclic_lock, lockctx);
+
+    for (i = 0; i < dev->ucSlots; i++)
+    {
+        s = &dev->txSlot[dev->ucSlotOrder[i]];
+
+        img = s->img;
+        img.qwQueued = now;
+        img.qwLaunch = qwSof + s->qwOffset;
+
+        if (pcan_txq_put (&dev->txq[img.ucClass], &img))
+            dev->dwTxSlotLost++;
+        else
+            queued++;
+    }
+
+    rtdm_lock_put_irqrestore (&dev->cyclic_lock, lockctx);
+
+    return queued;
+}
@@ -0,0 +1,29 @@
+#ifndef __PCAN_CYCLIC_H__
+#define __PCAN_CYCLIC_H__
+/* 
+ * Driver for dual-port isolated CAN interface card
+ * Copyright (C) 2011  Peter Kotvan <peter.kotvan@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <adlink_main.h>
+
+void pcan_cyclic_reset (struct pcandev *dev);
+int pcan_cyclic_set (struct pcandev *dev, TPCYCLIC * job);
+nanosecs_abs_t pcan_cyclic_fire (struct pcandev *dev, nanosecs_abs_t now);
+int pcan_matrix_set_reference (struct pcandev *dev, TPTXREF * ref);
+int pcan_matrix_set_slot (struct pcandev *dev, TPTXSLOT * slot);
+int pcan_matrix_trigger (struct pcandev *dev, nanosecs_abs_t qwSof);
+
+#endif /* __PCAN_CYCLIC_H__ */
@@ -25,25 +25,50 @@
 #include <linux/errno.h>        /* error codes */
 #include <linux/string.h>       /* memcpy */
 #include <linux/sched.h>
-#include <asm/system.h>         /* cli(), save_flags(), restore_flags() */
-#include <linux/spinlock.h>
+#include <asm/system.h>         /* mb(), wmb() */
 
 #include <adlink_fifo.h>
 
+/*
+ * A fifo has one producer and one consumer at a time, the interrupt handler
+ * being one of them. dwPut is only written by the producer, dwGet only by
+ * the consumer, so neither side needs a lock against the other. Several
+ * producers or consumers have to be serialized by their callers.
+ */
+
+/* the element following p */
+static inline void *
+pcan_fifo_next (FIFO_MANAGER * anchor, void *p)
+{
+    return (p < anchor->bufferEnd) ? p + anchor->wStepSize : anchor->bufferBegin;
+}
+
+/* only allowed if neither producer nor consumer are active */
 int
 pcan_fifo_reset (register FIFO_MANAGER * anchor)
 {
-    DECLARE_SPIN_LOCK_IRQSAVE_FLAGS;
-
-    SPIN_LOCK_IRQSAVE (&anchor->lock);
-
     anchor->dwTotal = 0;
-    anchor->nStored = 0;
+    anchor->dwPut = anchor->dwGet = 0;
     anchor->r = anchor->w = anchor->bufferBegin;        // nothing to read
+    mb ();
+
+    /* DPRINTK("pcan_fifo_reset() %d %p %pd\n", pcan_fifo_status(anchor), anchor->r, anchor->w); */
+
+    return 0;
+}
 
-    SPIN_UNLOCK_IRQRESTORE (&anchor->lock);
+/* discard all stored elements, done on the consumer side */
+int
+pcan_fifo_flush (register FIFO_MANAGER * anchor)
+{
+    u32 dwPut = anchor->dwPut;
+    u32 n;
+
+    mb ();
+    for (n = dwPut - anchor->dwGet; n; n--)
+        anchor->r = pcan_fifo_next (anchor, anchor->r);
 
-    /* DPRINTK("pcan_fifo_reset() %d %p %pd\n", anchor->nStored, anchor->r, anchor->w); */
+    anchor->dwGet = dwPut;
 
     return 0;
 }
@@ -63,68 +88,51 @@ pcan_fifo_init (register FIFO_MANAGER * anchor, void *bufferBegin, void *bufferE
         || (nCount <= 1))
         return -EINVAL;
 
-    INIT_LOCK (&anchor->lock);
-
     return pcan_fifo_reset (anchor);
 }
 
 int
 pcan_fifo_put (register FIFO_MANAGER * anchor, void *pvPutData)
 {
-    int err = 0;
-    DECLARE_SPIN_LOCK_IRQSAVE_FLAGS;
-
-    /* DPRINTK("sn_fifo_put() %d %p %p\n", anchor->nStored, anchor->r, anchor->w); */
-
-    SPIN_LOCK_IRQSAVE (&anchor->lock);
+    /* DPRINTK("sn_fifo_put() %d %p %p\n", pcan_fifo_status(anchor), anchor->r, anchor->w); */
 
-    if (anchor->nStored < anchor->nCount)
-    {
-        memcpy (anchor->w, pvPutData, anchor->wCopySize);
+    if (anchor->dwPut - anchor->dwGet >= anchor->nCount)
+        return -ENOSPC;
 
-        anchor->nStored++;
-        anchor->dwTotal++;
+    /* the consumer has left the element before it published dwGet */
+    mb ();
 
-        if (anchor->w < anchor->bufferEnd)
-            anchor->w += anchor->wStepSize;     // increment to next
-        else
-            anchor->w = anchor->bufferBegin;    // start from begin
-    }
-    else
-        err = -ENOSPC;
+    memcpy (anchor->w, pvPutData, anchor->wCopySize);
+    anchor->w = pcan_fifo_next (anchor, anchor->w);
+    anchor->dwTotal++;
 
-    SPIN_UNLOCK_IRQRESTORE (&anchor->lock);
+    /* publish the element only when it is complete */
+    wmb ();
+    anchor->dwPut++;
 
-    return err;
+    return 0;
 }
 
 
 int
 pcan_fifo_get (register FIFO_MANAGER * anchor, void *pvGetData)
 {
-    int err = 0;
-    DECLARE_SPIN_LOCK_IRQSAVE_FLAGS;
-
-    /* DPRINTK("pcan_fifo_get() %d %p %p\n", anchor->nStored, anchor->r, anchor->w); */
+    /* DPRINTK("pcan_fifo_get() %d %p %p\n", pcan_fifo_status(anchor), anchor->r, anchor->w); */
 
-    SPIN_LOCK_IRQSAVE (&anchor->lock);
+    if (anchor->dwPut == anchor->dwGet)
+        return -ENODATA;
 
-    if (anchor->nStored > 0)
-    {
-        memcpy (pvGetData, anchor->r, anchor->wCopySize);
+    /* read the element not before the producer published it */
+    rmb ();
 
-        anchor->nStored--;
-        if (anchor->r < anchor->bufferEnd)
-            anchor->r += anchor->wStepSize;     /* increment to next */
-        else
-            anchor->r = anchor->bufferBegin;    /* start from begin */
-    }
-    else
-        err = -ENODATA;
+    memcpy (pvGetData, anchor->r, anchor->wCopySize);
+    anchor->r = pcan_fifo_next (anchor, anchor->r);
 
-    SPIN_UNLOCK_IRQRESTORE (&anchor->lock);
+    /* hand the element back only after it was copied */
+    mb ();
+    anchor->dwGet++;
 
-    return err;
+    return 0;
 }
 
 
@@ -132,7 +140,7 @@ pcan_fifo_get (register FIFO_MANAGER * anchor, void *pvGetData)
 int
 pcan_fifo_status (FIFO_MANAGER * anchor)
 {
-    return anchor->nStored;
+    return anchor->dwPut - anchor->dwGet;
 }
 
 /* returns 0 if the fifo is full */
@@ -140,16 +148,9 @@ int
 pcan_fifo_not_full (FIFO_MANAGER * anchor)
 {
 #ifdef PCAN_FIFO_FIX_NOT_FULL_TEST
-    int r;
-    DECLARE_SPIN_LOCK_IRQSAVE_FLAGS;
-
-    SPIN_LOCK_IRQSAVE (&anchor->lock);
-    r = (anchor->nStored < anchor->nCount);
-    SPIN_UNLOCK_IRQRESTORE (&anchor->lock);
-
-    return r;
+    return (pcan_fifo_status (anchor) < anchor->nCount);
 #else
-    return (anchor->nStored < (anchor->nCount - 1));
+    return (pcan_fifo_status (anchor) < (anchor->nCount - 1));
 #endif
 }
 
@@ -157,5 +158,5 @@ pcan_fifo_not_full (FIFO_MANAGER * anchor)
 int
 pcan_fifo_empty (FIFO_MANAGER * anchor)
 {
-    return !(anchor->nStored);
+    return (anchor->dwPut == anchor->dwGet);
 }
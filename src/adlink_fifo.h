@@ -20,6 +20,7 @@
 #include <adlink_main.h>
 
 int pcan_fifo_reset (register FIFO_MANAGER * anchor);
+int pcan_fifo_flush (register FIFO_MANAGER * anchor);
 int pcan_fifo_init (register FIFO_MANAGER * anchor, void *bufferBegin, void *bufferEnd, int nCount,
                     u16 wCopySize);
 int pcan_fifo_put (register FIFO_MANAGER * anchor, void *pvPutData);
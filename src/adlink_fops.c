@@ -45,6 +45,8 @@
 #include <adlink_pci.h>
 #include <adlink_sja1000.h>
 #include <adlink_fifo.h>
+#include <adlink_txq.h>
+#include <adlink_cyclic.h>
 #include <adlink_fops.h>
 #include <adlink_parse.h>
 #include <adlink_filter.h>
@@ -65,6 +67,15 @@ MODULE_PARM (assign, "s");
 
 MODULE_PARM_DESC (bitrate, "The initial bitrate (BTR0BTR1) for all channels");
 
+/* write frames straight into an idle transmitter, bypassing the write fifo */
+static int direct_write = 1;
+module_param (direct_write, int, 0644);
+MODULE_PARM_DESC (direct_write, "Let the write ioctl load an idle transmitter itself (0 = always queue)");
+
+/* a transmitter without progress for this many frame times is checked for a stall */
+static int tx_watchdog = 10;
+module_param (tx_watchdog, int, 0644);
+MODULE_PARM_DESC (tx_watchdog, "Period of the transmit watchdog in longest frame times (0 = off)");
 
 /* wait this time in msec at max after releasing the device - give fifo a chance to flush */
 #define MAX_WAIT_UNTIL_CLOSE 1000
@@ -86,10 +97,11 @@ pcan_open_path (PCAN_OPEN_PATH_ARGS)
     if (!dev->nOpenPaths)
     {
         /* empty all FIFOs */
-        err = pcan_fifo_reset (&dev->writeFifo);
+        pcan_tx_reset (dev);
+        err = pcan_fifo_reset (&dev->readFifo);
         if (err)
             return err;
-        err = pcan_fifo_reset (&dev->readFifo);
+        err = pcan_fifo_reset (&dev->reportFifo);
         if (err)
             return err;
 
@@ -117,6 +129,8 @@ pcan_open_path (PCAN_OPEN_PATH_ARGS)
             DPRINTK ("can't open device hardware itself!\n");
             return err;
         }
+
+        pcan_tx_watchdog_start (dev);
     }
 
     dev->nOpenPaths++;
@@ -181,6 +195,16 @@ pcan_release_path (PCAN_RELEASE_PATH_ARGS)
         /* release the device itself */
         dev->device_release (dev);
 
+        /* frames left over by their shapers are not pushed anymore */
+        rtdm_timer_stop (&dev->tx_timer);
+        dev->qwTxTimerDue = 0;
+
+        rtdm_timer_stop (&dev->wd_timer);
+
+        /* cyclic jobs and the transmit matrix end with the last path */
+        rtdm_timer_stop (&dev->cyclic_timer);
+        pcan_cyclic_reset (dev);
+
         dev->release (dev);
         dev->nOpenPaths = 0;
 
@@ -199,15 +223,15 @@ pcan_ioctl_extended_status_common (struct pcandev *dev)
 
     local.wErrorFlag = dev->wCANStatus;
 
-    local.nPendingReads = dev->readFifo.nStored;
+    local.nPendingReads = pcan_fifo_status (&dev->readFifo);
 
     /* get infos for friends of polling operation */
     if (pcan_fifo_empty (&dev->readFifo))
         local.wErrorFlag |= CAN_ERR_QRCVEMPTY;
 
-    local.nPendingWrites = (dev->writeFifo.nStored + ((atomic_read (&dev->DataSendReady)) ? 0 : 1));
+    local.nPendingWrites = (pcan_tx_pending (dev) + ((atomic_read (&dev->DataSendReady)) ? 0 : 1));
 
-    if (!pcan_fifo_not_full (&dev->writeFifo))
+    if (!pcan_txq_not_full (&dev->txq[PCAN_TX_NORMAL]))
         local.wErrorFlag |= CAN_ERR_QXMTFULL;
 
     local.nLastError = dev->nLastError;
@@ -229,7 +253,7 @@ pcan_ioctl_status_common (struct pcandev * dev)
     if (pcan_fifo_empty (&dev->readFifo))
         local.wErrorFlag |= CAN_ERR_QRCVEMPTY;
 
-    if (!pcan_fifo_not_full (&dev->writeFifo))
+    if (!pcan_txq_not_full (&dev->txq[PCAN_TX_NORMAL]))
         local.wErrorFlag |= CAN_ERR_QXMTFULL;
 
     local.nLastError = dev->nLastError;
@@ -254,7 +278,7 @@ pcan_ioctl_diag_common (struct pcandev * dev)
         break;
     }
     local.dwReadCounter = dev->readFifo.dwTotal;
-    local.dwWriteCounter = dev->writeFifo.dwTotal;
+    local.dwWriteCounter = pcan_tx_total (dev);
     local.dwIRQcounter = dev->dwInterruptCounter;
     local.dwErrorCounter = dev->dwErrorCounter;
     local.wErrorFlag = dev->wCANStatus;
@@ -263,7 +287,7 @@ pcan_ioctl_diag_common (struct pcandev * dev)
     if (pcan_fifo_empty (&dev->readFifo))
         local.wErrorFlag |= CAN_ERR_QRCVEMPTY;
 
-    if (!pcan_fifo_not_full (&dev->writeFifo))
+    if (!pcan_txq_not_full (&dev->txq[PCAN_TX_NORMAL]))
         local.wErrorFlag |= CAN_ERR_QXMTFULL;
 
     local.nLastError = dev->nLastError;
@@ -274,3 +298,105 @@ pcan_ioctl_diag_common (struct pcandev * dev)
 
     return local;
 }
+
+/**
+ * is called at user ioctl() with cmd = PCAN_GET_CHAN_STATS
+ */
+TPCHANSTATS
+pcan_ioctl_chan_stats_common (struct pcandev * dev)
+{
+    TPCHANSTATS local;
+
+    memset (&local, 0, sizeof (local));
+
+    local.dwResetSwitchNs = dev->dwResetSwitchNs;
+    local.dwResetSwitchMaxNs = dev->dwResetSwitchMaxNs;
+    local.dwNormalSwitchNs = dev->dwNormalSwitchNs;
+    local.dwNormalSwitchMaxNs = dev->dwNormalSwitchMaxNs;
+    local.dwSwitchTimeouts = dev->dwSwitchTimeouts;
+    local.dwReconfigResetNs = dev->dwReconfigResetNs;
+    local.dwReconfigResetMaxNs = dev->dwReconfigResetMaxNs;
+    local.dwIrqHandled = dev->dwIrqHandled;
+    local.dwIrqForeign = dev->dwIrqForeign;
+    local.dwStageOverruns = dev->dwStageOverruns;
+    local.dwTxRequests = dev->dwTxRequests;
+    local.dwTxDirect = dev->dwTxDirect;
+    local.dwTxLatencyMaxNs = dev->dwTxLatencyMaxNs;
+    local.dwTxAborts = dev->dwTxAborts;
+    local.dwTxShaped = dev->dwTxShaped;
+    local.dwTxStallRecoveries = dev->dwTxStallRecoveries;
+    local.dwTxCyclicLost = dev->dwTxCyclicLost;
+    local.dwTxReferences = dev->dwTxReferences;
+    local.dwTxSlotLost = dev->dwTxSlotLost;
+    local.dwTxCollapsed = dev->dwTxCollapsed;
+    local.dwTxExpired = dev->dwTxExpired;
+    local.dwTxSingleShotFailed = dev->dwTxSingleShotFailed;
+    local.dwTxReportsLost = dev->dwTxReportsLost;
+    local.dwIsrMaxNs = dev->dwIsrMaxNs;
+    local.dwBitErrors = dev->dwBitErrors;
+    local.dwFormErrors = dev->dwFormErrors;
+    local.dwStuffErrors = dev->dwStuffErrors;
+    local.dwOtherErrors = dev->dwOtherErrors;
+    local.dwAckErrors = dev->dwAckErrors;
+    local.dwCrcErrors = dev->dwCrcErrors;
+    local.dwTxBusErrors = dev->dwTxBusErrors;
+    local.dwArbitLost = dev->dwArbitLost;
+    if (dev->device_error_counters)
+    {
+        u8 ucRxErrors;
+        u8 ucTxErrors;
+
+        dev->device_error_counters (dev, &ucRxErrors, &ucTxErrors);
+        local.dwRxErrorCounter = ucRxErrors;
+        local.dwTxErrorCounter = ucTxErrors;
+    }
+    if (local.dwTxRequests)
+    {
+        u64 qwTotal = dev->qwTxLatencyTotalNs;
+
+        do_div (qwTotal, local.dwTxRequests);
+        local.dwTxLatencyAvgNs = (u32) qwTotal;
+    }
+    local.dwIsrCount = dev->dwIsrCount;
+    local.qwIsrTotalNs = dev->qwIsrTotalNs;
+    if (dev->dwIsrCount)
+    {
+        u64 qwTotal = dev->qwIsrTotalNs;
+
+        do_div (qwTotal, dev->dwIsrCount);
+        local.dwIsrAvgNs = (u32) qwTotal;
+    }
+
+    return local;
+}
+
+/* take a consistent copy of the usage of a lock */
+static void
+pcan_lock_stat (PCAN_LOCK * l, TPLOCKSTAT * stat)
+{
+    rtdm_lockctx_t lockctx;
+
+    /* the raw lock, reading the statistics must not count as usage */
+    rtdm_lock_get_irqsave (&l->lock, lockctx);
+    stat->dwAcquired = l->dwAcquired;
+    stat->dwContended = l->dwContended;
+    stat->dwHoldMaxNs = l->dwHoldMaxNs;
+    stat->qwHoldTotalNs = l->qwHoldTotalNs;
+    rtdm_lock_put_irqrestore (&l->lock, lockctx);
+}
+
+/**
+ * is called at user ioctl() with cmd = PCAN_GET_LOCK_STATS
+ */
+TPLOCKSTATS
+pcan_ioctl_lock_stats_common (struct pcandev * dev)
+{
+    TPLOCKSTATS local;
+
+    memset (&local, 0, sizeof (local));
+
+    pcan_lock_stat (&dev->chip_lock, &local.Chip);
+    pcan_lock_stat (&dev->rx_lock, &local.Rx);
+
+    return local;
+}
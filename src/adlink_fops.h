@@ -29,6 +29,12 @@ struct pcandev *pcan_search_dev (int major, int minor);
 TPEXTENDEDSTATUS pcan_ioctl_extended_status_common (struct pcandev *dev);
 TPSTATUS pcan_ioctl_status_common (struct pcandev *dev);
 TPDIAG pcan_ioctl_diag_common (struct pcandev *dev);
+TPCHANSTATS pcan_ioctl_chan_stats_common (struct pcandev *dev);
+TPLOCKSTATS pcan_ioctl_lock_stats_common (struct pcandev *dev);
+
+void pcan_tx_timer_rt (rtdm_timer_t * timer);
+void pcan_cyclic_timer_rt (rtdm_timer_t * timer);
+void pcan_tx_watchdog_rt (rtdm_timer_t * timer);
 
 extern struct rtdm_device adlinkdev_rt;
 
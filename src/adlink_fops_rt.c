@@ -21,7 +21,7 @@
 
 #define PCAN_OPEN_PATH_ARGS struct pcandev *dev, struct rtdm_dev_context *context
 #define PCAN_RELEASE_PATH_ARGS struct pcandev *dev, struct pcanctx_rt *ctx
-#define REQ_IRQ_ARG context
+#define REQ_IRQ_ARG dev
 
 #if RTDM_API_VER < 6
 #define IOCTL_REQUEST_TYPE int
@@ -29,7 +29,7 @@
 #define IOCTL_REQUEST_TYPE unsigned int
 #endif
 
-// TODO  wait_until_fifo_empty(dev, MAX_WAIT_UNTIL_CLOSE, ctx);
+// TODO  wait_until_fifo_empty(dev, MAX_WAIT_UNTIL_CLOSE);
 #define WAIT_UNTIL_FIFO_EMPTY()
 
 static int
@@ -62,23 +62,147 @@ copy_to_user_rt (rtdm_user_info_t * user_info, void *to, void *from, size_t size
 }
 
 static void
-wait_until_fifo_empty (struct pcandev *dev, u32 mTime, struct pcanctx_rt *ctx)
+wait_until_fifo_empty (struct pcandev *dev, u32 mTime)
 {
-    int fifo_not_empty;
+    /* clear before testing, an interrupt emptying the fifo in between signals again */
+    rtdm_event_clear (&dev->empty_event);
+    mb ();
+
+    if (pcan_tx_pending (dev))
+        rtdm_event_timedwait (&dev->empty_event, mTime * 1000, NULL);
+}
+
+/* start the transmitter if it is idle, otherwise its next interrupt takes the queued frame */
+static int
+pcan_push_write_rt (struct pcandev *dev)
+{
+    int err = 0;
+    rtdm_lockctx_t lockctx;
+
+    /* claim the idle transmitter and load it in one step, a late transmit interrupt
+     * finding it claimed in between would take it for the frame in flight */
+    pcan_lock_get_irqsave (&dev->chip_lock, &lockctx);
+    if (atomic_cmpxchg (&dev->DataSendReady, 1, 0) == 1)
+    {
+        err = dev->device_write (dev);
+
+        /* nothing due or the buffer still occupied, the transmitter stays idle */
+        if (err)
+            atomic_set (&dev->DataSendReady, 1);
+        if (err == -ENODATA || err == -EAGAIN || err == -EBUSY)
+            err = 0;
+    }
+    pcan_lock_put_irqrestore (&dev->chip_lock, &lockctx);
+
+    return err;
+}
+
+/* a frame held back by a shaper or by its launch time got due */
+void
+pcan_tx_timer_rt (rtdm_timer_t * timer)
+{
+    struct pcandev *dev = container_of (timer, struct pcandev, tx_timer);
+    rtdm_lockctx_t lockctx;
+    nanosecs_abs_t due;
+
+    pcan_lock_get_irqsave (&dev->chip_lock, &lockctx);
+    due = dev->qwTxTimerDue;
+    dev->qwTxTimerDue = 0;
+    pcan_lock_put_irqrestore (&dev->chip_lock, &lockctx);
+
+    /* the timer was started up to launch_spin_ns early, the rest is spun off without chip_lock */
+    if (due > rtdm_clock_read () + pcan_tx_launch_spin ())
+        due = 0;
+    while (due > rtdm_clock_read ())
+        cpu_relax ();
+
+    pcan_push_write_rt (dev);
+}
+
+/* the frames of one or more cyclic jobs got due */
+void
+pcan_cyclic_timer_rt (rtdm_timer_t * timer)
+{
+    struct pcandev *dev = container_of (timer, struct pcandev, cyclic_timer);
+    nanosecs_abs_t next;
+
+    next = pcan_cyclic_fire (dev, rtdm_clock_read ());
+    if (next)
+        rtdm_timer_start_in_handler (&dev->cyclic_timer, next, 0, RTDM_TIMERMODE_ABSOLUTE);
+
+    pcan_push_write_rt (dev);
+}
+
+/* look for a stalled transmitter */
+void
+pcan_tx_watchdog_rt (rtdm_timer_t * timer)
+{
+    struct pcandev *dev = container_of (timer, struct pcandev, wd_timer);
+
+    dev->device_tx_watchdog (dev);
+}
+
+/* (re)start the transmit watchdog with a period fitting the bitrate */
+static void
+pcan_tx_watchdog_start (struct pcandev *dev)
+{
+    nanosecs_rel_t period;
+
+    rtdm_timer_stop (&dev->wd_timer);
+    dev->ucTxStallSuspect = 0;
+
+    if (tx_watchdog <= 0 || !dev->device_tx_watchdog)
+        return;
+
+    period = (nanosecs_rel_t) tx_watchdog * FRAME_BITS_MAX * dev->dwBitTimeNs;
+    if (period < 100000)
+        period = 100000;
+
+    rtdm_timer_start (&dev->wd_timer, period, period, RTDM_TIMERMODE_RELATIVE);
+}
+
+/* load an idle transmitter with nothing queued directly */
+static int
+pcan_write_direct_rt (struct pcandev *dev, TX_IMAGE * img)
+{
+    int err;
     rtdm_lockctx_t lockctx;
 
-    rtdm_lock_get_irqsave (&ctx->out_lock, lockctx);
+    /* frames queued before must leave first */
+    if (pcan_tx_pending (dev))
+        return -EBUSY;
+
+    /* only one may claim the idle transmitter, together with the look at the transmit buffer */
+    pcan_lock_get_irqsave (&dev->chip_lock, &lockctx);
+    if (atomic_cmpxchg (&dev->DataSendReady, 1, 0) != 1)
+        err = -EBUSY;
+    else if ((err = dev->device_write_image (dev, img)))
+        atomic_set (&dev->DataSendReady, 1);
+    pcan_lock_put_irqrestore (&dev->chip_lock, &lockctx);
+
+    /* otherwise the transmit interrupt of this frame hands the transmitter back */
+    return err;
+}
 
-    fifo_not_empty = !pcan_fifo_empty (&dev->writeFifo);
-    if (fifo_not_empty)
-        rtdm_event_clear (&ctx->empty_event);
+/* discard the contents of both fifos, each from its consumer side */
+static int
+pcan_flush_fifos_rt (struct pcandev *dev)
+{
+    int err;
+    rtdm_lockctx_t lockctx;
 
-    rtdm_lock_put_irqrestore (&ctx->out_lock, lockctx);
+    /* the transmit queue is consumed by whoever holds the chip */
+    pcan_lock_get_irqsave (&dev->chip_lock, &lockctx);
+    err = pcan_tx_flush (dev);
+    pcan_lock_put_irqrestore (&dev->chip_lock, &lockctx);
+    if (err)
+        return err;
 
-    if (fifo_not_empty)
-        rtdm_event_timedwait (&ctx->empty_event, mTime * 1000, NULL);
+    pcan_lock_get_irqsave (&dev->rx_lock, &lockctx);
+    err = pcan_fifo_flush (&dev->readFifo);
+    pcan_lock_put_irqrestore (&dev->rx_lock, &lockctx);
 
-    atomic_set (&dev->DataSendReady, 1);
+    return err;
 }
 
 /* is called when the path is opened */
@@ -88,6 +212,7 @@ pcan_open_rt (struct rtdm_dev_context *context, rtdm_user_info_t * user_info, in
     struct pcandev *dev;
     int err = 0;
     struct pcanctx_rt *ctx;
+    rtdm_lockctx_t lockctx;
     int _major = MAJOR (context->device->device_id);
     int _minor = MINOR (context->device->device_id);
 
@@ -97,11 +222,11 @@ pcan_open_rt (struct rtdm_dev_context *context, rtdm_user_info_t * user_info, in
 
     /* IPC initialisation - cannot fail with used parameters */
     rtdm_event_init (&ctx->in_event, 0);
-    rtdm_event_init (&ctx->out_event, 1);
-    rtdm_event_init (&ctx->empty_event, 1);
-    rtdm_lock_init (&ctx->in_lock);
-    rtdm_lock_init (&ctx->out_lock);
-    rtdm_lock_init (&ctx->sja_lock);
+    rtdm_event_init (&ctx->echo_event, 0);
+    rtdm_lock_init (&ctx->echo_lock);
+    pcan_fifo_init (&ctx->echoFifo, &ctx->echo[0], &ctx->echo[ECHO_COUNT - 1], ECHO_COUNT,
+                    sizeof (TPCANEcho));
+    ctx->dwEchoLost = 0;
 
     /* TBD: get the device major number from xenomai structure... */
     dev = pcan_search_dev (_major, _minor);
@@ -114,22 +239,24 @@ pcan_open_rt (struct rtdm_dev_context *context, rtdm_user_info_t * user_info, in
     ctx->pcReadPointer = ctx->pcReadBuffer;
     ctx->nWriteCount = 0;
     ctx->pcWritePointer = ctx->pcWriteBuffer;
-
-    if (dev->wType == HW_PCI)
-        ctx->irq = dev->port.pci.wIrq;
+    ctx->dwTxExpired = 0;
 
     err = pcan_open_path (dev, context);
-    if (err)
-        return err;
-
-    /* enable IRQ interrupts */
-    err = rtdm_irq_enable (&ctx->irq_handle);
     if (err)
     {
-        DPRINTK ("can't enable interrupt\n");
+        rtdm_event_destroy (&ctx->in_event);
+        rtdm_event_destroy (&ctx->echo_event);
         return err;
     }
 
+    /* from now on the interrupt handler wakes this context too */
+    rtdm_lock_get_irqsave (&dev->ctx_lock, lockctx);
+    do
+        ctx->wCtxId = ++dev->wLastCtxId;
+    while (!ctx->wCtxId);
+    list_add_tail (&ctx->list, &dev->ctx_list);
+    rtdm_lock_put_irqrestore (&dev->ctx_lock, lockctx);
+
     DPRINTK ("pcan_open_rt() is OK\n");
 
     return err;
@@ -141,6 +268,7 @@ pcan_close_rt (struct rtdm_dev_context *context, rtdm_user_info_t * user_info)
 {
     struct pcandev *dev;
     struct pcanctx_rt *ctx;
+    rtdm_lockctx_t lockctx;
 
     DPRINTK ("pcan_close_rt()\n");
 
@@ -148,45 +276,30 @@ pcan_close_rt (struct rtdm_dev_context *context, rtdm_user_info_t * user_info)
 
     dev = ctx->dev;
 
-    /* first, prevent pending fops to act if unblocked */
-    dev->ucPhysicallyInstalled = 0;
-
-    /* then remove IRQ */
-    /*rtdm_irq_disable(&ctx->irq_handle); */
+    /* the interrupt handler must not signal this context any more */
+    rtdm_lock_get_irqsave (&dev->ctx_lock, lockctx);
+    list_del (&ctx->list);
+    rtdm_lock_put_irqrestore (&dev->ctx_lock, lockctx);
 
+    /* the last release of the device frees the interrupt */
     pcan_release_path (dev, ctx);
 
-    rtdm_irq_free (&ctx->irq_handle);
-
-    /* will unblock pending fops */
-    rtdm_event_destroy (&ctx->out_event);
+    /* will unblock pending reads of this context */
     rtdm_event_destroy (&ctx->in_event);
-
-    rtdm_event_destroy (&ctx->empty_event);
-
-    /* restore device presence */
-    dev->ucPhysicallyInstalled = 1;
-
-    /* as wait_until_fifo_empty is not called in RT, */
-    /* have to fix DataSendReady here, */
-    /* so that device can transmit again */
-    atomic_set (&dev->DataSendReady, 1);
+    rtdm_event_destroy (&ctx->echo_event);
 
     return 0;
 }
 
-/* is called at user ioctl() with cmd = PCAN_READ_MSG */
-int
-pcan_ioctl_read_rt (rtdm_user_info_t * user_info, struct pcanctx_rt *ctx, TPCANRdMsg * usr)
+/* take up to count entries out of the read fifo, wait for one if the fifo is empty */
+static int
+pcan_read_fifo_rt (struct pcanctx_rt *ctx, RX_IMAGE * img, int count)
 {
     int err = 0;
-    TPCANRdMsg msg;
-
+    int n;
     struct pcandev *dev;
     rtdm_lockctx_t lockctx;
 
-    DPRINTK ("pcan_ioctl_rt(PCAN_READ_MSG)\n");
-
     dev = ctx->dev;
 
     /* if the device is plugged out */
@@ -195,19 +308,45 @@ pcan_ioctl_read_rt (rtdm_user_info_t * user_info, struct pcanctx_rt *ctx, TPCANR
 
     do
     {
-        rtdm_lock_get_irqsave (&ctx->in_lock, lockctx);
+        /* the interrupt handler is the only producer, readers only exclude each other */
+        pcan_lock_get_irqsave (&dev->rx_lock, &lockctx);
 
-        /* get data out of fifo */
-        err = pcan_fifo_get (&dev->readFifo, (void *) &msg);
+        /* get data out of fifo, raw images are copied only and decoded after unlocking */
+        for (n = 0; n < count; n++)
+            if (pcan_fifo_get (&dev->readFifo, (void *) &img[n]))
+                break;
 
-        rtdm_lock_put_irqrestore (&ctx->in_lock, lockctx);
+        pcan_lock_put_irqrestore (&dev->rx_lock, &lockctx);
+
+        if (n)
+            return n;
     }
-    while (err == -ENODATA && !(err = rtdm_event_wait (&ctx->in_event)));
+    while (!(err = rtdm_event_wait (&ctx->in_event)));
 
-    if (err)
-    {
+    return err;
+}
+
+/* is called at user ioctl() with cmd = PCAN_READ_MSG */
+int
+pcan_ioctl_read_rt (rtdm_user_info_t * user_info, struct pcanctx_rt *ctx, TPCANRdMsg * usr)
+{
+    int err = 0;
+    RX_IMAGE img;
+    TPCANRdMsgNs local;
+    TPCANRdMsg msg;
+
+    DPRINTK ("pcan_ioctl_rt(PCAN_READ_MSG)\n");
+
+    err = pcan_read_fifo_rt (ctx, &img, 1);
+    if (err < 0)
         goto fail;
-    }
+    err = 0;
+
+    pcan_rx_decode (ctx->dev, &img, &local);
+
+    /* the legacy timestamp is only computed for clients asking for it */
+    msg.Msg = local.Msg;
+    ns2pcan (local.qwTimestamp, &msg.dwTime, &msg.wUsec);
 
     if (copy_to_user_rt (user_info, usr, &msg, sizeof (*usr)))
         err = -EFAULT;
@@ -216,76 +355,354 @@ pcan_ioctl_read_rt (rtdm_user_info_t * user_info, struct pcanctx_rt *ctx, TPCANR
     return err;
 }
 
+/* is called at user ioctl() with cmd = PCAN_READ_MSG_NS */
+int
+pcan_ioctl_read_ns_rt (rtdm_user_info_t * user_info, struct pcanctx_rt *ctx, TPCANRdMsgNs * usr)
+{
+    int err = 0;
+    RX_IMAGE img;
+    TPCANRdMsgNs msg;
+
+    DPRINTK ("pcan_ioctl_rt(PCAN_READ_MSG_NS)\n");
+
+    err = pcan_read_fifo_rt (ctx, &img, 1);
+    if (err < 0)
+        goto fail;
+    err = 0;
+
+    pcan_rx_decode (ctx->dev, &img, &msg);
+
+    if (copy_to_user_rt (user_info, usr, &msg, sizeof (*usr)))
+        err = -EFAULT;
+
+  fail:
+    return err;
+}
+
+/* is called at user ioctl() with cmd = PCAN_READ_MSGS_NS */
+int
+pcan_ioctl_read_msgs_ns_rt (rtdm_user_info_t * user_info, struct pcanctx_rt *ctx,
+                            TPCANRdMsgsNs * usr)
+{
+    int err = 0;
+    int i;
+    u32 dwCount;
+    RX_IMAGE img[PCAN_READ_BATCH];
+    TPCANRdMsgNs msg[PCAN_READ_BATCH];
+
+    DPRINTK ("pcan_ioctl_rt(PCAN_READ_MSGS_NS)\n");
+
+    if (copy_from_user_rt (user_info, &dwCount, &usr->dwCount, sizeof (dwCount)))
+        return -EFAULT;
+
+    if (!dwCount)
+        return -EINVAL;
+    if (dwCount > PCAN_READ_BATCH)
+        dwCount = PCAN_READ_BATCH;
+
+    err = pcan_read_fifo_rt (ctx, img, dwCount);
+    if (err < 0)
+        goto fail;
+
+    /* decode the whole batch at once, outside of any lock */
+    dwCount = err;
+    for (i = 0; i < dwCount; i++)
+        pcan_rx_decode (ctx->dev, &img[i], &msg[i]);
+
+    err = 0;
+    if (copy_to_user_rt (user_info, usr->Msgs, msg, dwCount * sizeof (msg[0])) ||
+        copy_to_user_rt (user_info, &usr->dwCount, &dwCount, sizeof (dwCount)))
+        err = -EFAULT;
+
+  fail:
+    return err;
+}
+
+/* give a less urgent frame in the transmit buffer a chance to make room for a frame of ucClass */
+static void
+pcan_preempt_rt (struct pcandev *dev, u8 ucClass)
+{
+    rtdm_lockctx_t lockctx;
+
+    pcan_lock_get_irqsave (&dev->chip_lock, &lockctx);
+    dev->device_preempt (dev, ucClass);
+    pcan_lock_put_irqrestore (&dev->chip_lock, &lockctx);
+}
+
+/* queue a message for transmission, common to all write ioctls */
+static int
+pcan_write_msg_rt (struct pcanctx_rt *ctx, TPCANWrMsg * wmsg)
+{
+    int err = 0;
+    struct pcandev *dev = ctx->dev;
+    struct can_frame cf;
+    TX_IMAGE img;
+    TX_QUEUE *q;
+
+    /* filter extended data if initialized to standard only */
+    if (!(dev->bExtended) && ((wmsg->Msg.MSGTYPE & MSGTYPE_EXTENDED) || (wmsg->Msg.ID > 2047)))
+        return -EINVAL;
+
+    if (wmsg->ucClass >= PCAN_TX_CLASSES)
+        return -EINVAL;
+
+    /* marshal up front, the interrupt handler only copies the image to the chip */
+    msg2frame (&cf, &wmsg->Msg);
+    dev->device_marshal (&cf, &img);
+    img.ucClass = wmsg->ucClass;
+    img.qwQueued = rtdm_clock_read ();
+    img.qwLaunch = (wmsg->qwLaunchTime > img.qwQueued) ? wmsg->qwLaunchTime : 0;
+    img.qwDeadline = wmsg->qwDeadline;
+    img.wCtxId = ctx->wCtxId;
+    img.dwTag = wmsg->dwTag;
+    img.ucFlags = wmsg->ucFlags;
+
+    /* too late before it is even queued */
+    if (img.qwDeadline && img.qwDeadline <= max (img.qwQueued, img.qwLaunch))
+        return -ETIMEDOUT;
+
+    q = &dev->txq[img.ucClass];
+
+    /* writers do not exclude each other, only a full queue makes them wait */
+    for (;;)
+    {
+        /* if the device is plugged out */
+        if (!dev->ucPhysicallyInstalled)
+            return -ENODEV;
+
+        /* an idle transmitter takes the frame at once, unless it is scheduled */
+        if (direct_write && !img.qwLaunch && !pcan_write_direct_rt (dev, &img))
+            return 0;
+
+        if (wmsg->ucFlags & PCAN_WR_LATEST)
+            err = pcan_tx_put_latest (dev, &img);
+        else
+            err = pcan_txq_put (q, &img);
+        if (err != -ENOSPC)
+            break;
+
+        /* out_event is signalled after each frame the consumer took */
+        err = rtdm_event_wait (&dev->out_event);
+        if (err)
+            return err;
+    }
+
+    /* the frame is published, now claim the transmitter if it ran idle meanwhile */
+    if (!err)
+        err = pcan_push_write_rt (dev);
+
+    /* if a less urgent frame holds the transmitter, have it aborted and sent again later */
+    if (!err && !img.qwLaunch && img.ucClass < PCAN_TX_CLASSES - 1)
+        pcan_preempt_rt (dev, img.ucClass);
+
+    return err;
+}
+
 /* is called at user ioctl() with cmd = PCAN_WRITE_MSG */
 int
 pcan_ioctl_write_rt (rtdm_user_info_t * user_info, struct pcanctx_rt *ctx, TPCANMsg * usr)
 {
-    int err = 0;
-    TPCANMsg msg;
+    TPCANWrMsg wmsg;
+
+    DPRINTK ("pcan_ioctl_rt(PCAN_WRITE_MSG)\n");
+
+    /* get from user space */
+    if (copy_from_user_rt (user_info, &wmsg.Msg, usr, sizeof (wmsg.Msg)))
+        return -EFAULT;
+
+    wmsg.ucClass = PCAN_TX_NORMAL;
+    wmsg.ucFlags = 0;
+    wmsg.dwTag = 0;
+    wmsg.qwLaunchTime = 0;
+    wmsg.qwDeadline = 0;
+
+    return pcan_write_msg_rt (ctx, &wmsg);
+}
+
+/* is called at user ioctl() with cmd = PCAN_WRITE_MSG_EX */
+int
+pcan_ioctl_write_ex_rt (rtdm_user_info_t * user_info, struct pcanctx_rt *ctx, TPCANWrMsg * usr)
+{
+    TPCANWrMsg wmsg;
+
+    DPRINTK ("pcan_ioctl_rt(PCAN_WRITE_MSG_EX)\n");
+
+    if (copy_from_user_rt (user_info, &wmsg, usr, sizeof (wmsg)))
+        return -EFAULT;
+
+    return pcan_write_msg_rt (ctx, &wmsg);
+}
+
+/* is called at user ioctl() with cmd = PCAN_READ_TX_REPORT */
+int
+pcan_ioctl_read_tx_report_rt (rtdm_user_info_t * user_info, struct pcanctx_rt *ctx, TPTXREPORT * usr)
+{
+    int err;
+    TPTXREPORT local;
     struct pcandev *dev;
     rtdm_lockctx_t lockctx;
 
-    DPRINTK ("pcan_ioctl_rt(PCAN_WRITE_MSG)\n");
+    DPRINTK ("pcan_ioctl_rt(PCAN_READ_TX_REPORT)\n");
 
     dev = ctx->dev;
 
-    /* sleep until space is available */
-    err = rtdm_event_wait (&ctx->out_event);
-    if (err)
-        goto fail;
+    /* wait for a report if there is none */
+    do
+    {
+        if (!dev->ucPhysicallyInstalled)
+            return -ENODEV;
 
-    /* if the device is plugged out */
-    if (!dev->ucPhysicallyInstalled)
-        return -ENODEV;
+        rtdm_lock_get_irqsave (&dev->report_lock, lockctx);
+        err = pcan_fifo_get (&dev->reportFifo, &local);
+        rtdm_lock_put_irqrestore (&dev->report_lock, lockctx);
 
-    /* get from user space */
-    if (copy_from_user_rt (user_info, &msg, usr, sizeof (msg)))
-    {
-        err = -EFAULT;
-        goto fail;
+        if (!err)
+            break;
     }
+    while (!(err = rtdm_event_wait (&dev->report_event)));
 
-    /* filter extended data if initialized to standard only */
-    if (!(dev->bExtended) && ((msg.MSGTYPE & MSGTYPE_EXTENDED) || (msg.ID > 2047)))
+    if (err)
+        return err;
+
+    if (copy_to_user_rt (user_info, usr, &local, sizeof (local)))
+        return -EFAULT;
+
+    return 0;
+}
+
+/* is called at user ioctl() with cmd = PCAN_READ_ECHO */
+int
+pcan_ioctl_read_echo_rt (rtdm_user_info_t * user_info, struct pcanctx_rt *ctx, TPCANEcho * usr)
+{
+    int err;
+    TPCANEcho local;
+    rtdm_lockctx_t lockctx;
+
+    DPRINTK ("pcan_ioctl_rt(PCAN_READ_ECHO)\n");
+
+    /* wait for an echo if there is none */
+    do
     {
-        err = -EINVAL;
-        goto fail;
+        if (!ctx->dev->ucPhysicallyInstalled)
+            return -ENODEV;
+
+        rtdm_lock_get_irqsave (&ctx->echo_lock, lockctx);
+        err = pcan_fifo_get (&ctx->echoFifo, &local);
+        rtdm_lock_put_irqrestore (&ctx->echo_lock, lockctx);
+
+        if (!err)
+            break;
     }
+    while (!(err = rtdm_event_wait (&ctx->echo_event)));
+
+    if (err)
+        return err;
+
+    if (copy_to_user_rt (user_info, usr, &local, sizeof (local)))
+        return -EFAULT;
 
-    rtdm_lock_get_irqsave (&ctx->out_lock, lockctx);
+    return 0;
+}
+
+/* is called at user ioctl() with cmd = PCAN_SET_SHAPER */
+int
+pcan_ioctl_set_shaper_rt (rtdm_user_info_t * user_info, struct pcanctx_rt *ctx, TPSHAPER * usr)
+{
+    int err;
+    TPSHAPER local;
+    struct pcandev *dev;
+    rtdm_lockctx_t lockctx;
 
-    /* put data into fifo */
-    err = pcan_fifo_put (&dev->writeFifo, &msg);
+    DPRINTK ("pcan_ioctl_rt(PCAN_SET_SHAPER)\n");
 
-    /* if fifo not full or can device ready to send */
-    if (pcan_fifo_not_full (&dev->writeFifo) || atomic_read (&dev->DataSendReady))
-        rtdm_event_signal (&ctx->out_event);
-    rtdm_lock_put_irqrestore (&ctx->out_lock, lockctx);
+    dev = ctx->dev;
 
+    if (copy_from_user_rt (user_info, &local, usr, sizeof (local)))
+        return -EFAULT;
+
+    /* shapers are evaluated by the consumer of the transmit queues */
+    pcan_lock_get_irqsave (&dev->chip_lock, &lockctx);
+    err = pcan_tx_set_shaper (dev, &local);
+    pcan_lock_put_irqrestore (&dev->chip_lock, &lockctx);
+
+    /* frames held back by a shaper just relaxed may go now, the queues are only
+     * looked at under chip_lock */
     if (!err)
-    {
-        /* push a new transmission trough ioctl() only if interrupt triggered push was stalled */
-        mb ();
-        if (atomic_read (&dev->DataSendReady))
-        {
-            atomic_set (&dev->DataSendReady, 0);
-            mb ();
-            rtdm_lock_get_irqsave (&ctx->sja_lock, lockctx);
-            err = dev->device_write (dev, ctx);
-            rtdm_lock_put_irqrestore (&ctx->sja_lock, lockctx);
-            if (err)
-                atomic_set (&dev->DataSendReady, 1);
-        }
-        else
-        {
-            /* DPRINTK("pushed %d items into Fifo\n", dev->writeFifo.nStored); */
-        }
-    }
+        err = pcan_push_write_rt (dev);
 
-  fail:
     return err;
 }
 
+/* is called at user ioctl() with cmd = PCAN_SET_CYCLIC */
+int
+pcan_ioctl_set_cyclic_rt (rtdm_user_info_t * user_info, struct pcanctx_rt *ctx, TPCYCLIC * usr)
+{
+    int err;
+    TPCYCLIC local;
+    struct pcandev *dev;
+    nanosecs_abs_t next;
+
+    DPRINTK ("pcan_ioctl_rt(PCAN_SET_CYCLIC)\n");
+
+    dev = ctx->dev;
+
+    if (copy_from_user_rt (user_info, &local, usr, sizeof (local)))
+        return -EFAULT;
+
+    err = pcan_cyclic_set (dev, &local);
+    if (err)
+        return err;
+
+    /* nothing is due yet, this only finds the next expiry */
+    next = pcan_cyclic_fire (dev, 0);
+    if (next)
+        rtdm_timer_start (&dev->cyclic_timer, next, 0, RTDM_TIMERMODE_ABSOLUTE);
+    else
+        rtdm_timer_stop (&dev->cyclic_timer);
+
+    return 0;
+}
+
+/* is called at user ioctl() with cmd = PCAN_SET_TX_REFERENCE */
+int
+pcan_ioctl_set_tx_reference_rt (rtdm_user_info_t * user_info, struct pcanctx_rt *ctx, TPTXREF * usr)
+{
+    TPTXREF local;
+
+    DPRINTK ("pcan_ioctl_rt(PCAN_SET_TX_REFERENCE)\n");
+
+    if (copy_from_user_rt (user_info, &local, usr, sizeof (local)))
+        return -EFAULT;
+
+    return pcan_matrix_set_reference (ctx->dev, &local);
+}
+
+/* is called at user ioctl() with cmd = PCAN_SET_TX_SLOT */
+int
+pcan_ioctl_set_tx_slot_rt (rtdm_user_info_t * user_info, struct pcanctx_rt *ctx, TPTXSLOT * usr)
+{
+    TPTXSLOT local;
+
+    DPRINTK ("pcan_ioctl_rt(PCAN_SET_TX_SLOT)\n");
+
+    if (copy_from_user_rt (user_info, &local, usr, sizeof (local)))
+        return -EFAULT;
+
+    return pcan_matrix_set_slot (ctx->dev, &local);
+}
+
+/* clear the status handed to the user, bits the interrupt handler sets meanwhile are kept */
+static void
+pcan_clear_status_rt (struct pcandev *dev, u16 wReported)
+{
+    rtdm_lockctx_t lockctx;
+
+    pcan_lock_get_irqsave (&dev->chip_lock, &lockctx);
+    dev->wCANStatus &= ~wReported;
+    dev->nLastError = 0;
+    pcan_lock_put_irqrestore (&dev->chip_lock, &lockctx);
+}
+
 /* is called at user ioctl() with cmd = PCAN_GET_EXT_STATUS */
 int
 pcan_ioctl_extended_status_rt (rtdm_user_info_t * user_info, struct pcanctx_rt *ctx,
@@ -306,8 +723,7 @@ pcan_ioctl_extended_status_rt (rtdm_user_info_t * user_info, struct pcanctx_rt *
         goto fail;
     }
 
-    dev->wCANStatus = 0;
-    dev->nLastError = 0;
+    pcan_clear_status_rt (dev, local.wErrorFlag);
 
   fail:
     return err;
@@ -332,8 +748,7 @@ pcan_ioctl_status_rt (rtdm_user_info_t * user_info, struct pcanctx_rt *ctx, TPST
         goto fail;
     }
 
-    dev->wCANStatus = 0;
-    dev->nLastError = 0;
+    pcan_clear_status_rt (dev, local.wErrorFlag);
 
   fail:
     return err;
@@ -359,6 +774,42 @@ pcan_ioctl_diag_rt (rtdm_user_info_t * user_info, struct pcanctx_rt *ctx, TPDIAG
     return err;
 }
 
+/* is called at user ioctl() with cmd = PCAN_GET_CHAN_STATS */
+int
+pcan_ioctl_chan_stats_rt (rtdm_user_info_t * user_info, struct pcanctx_rt *ctx, TPCHANSTATS * stats)
+{
+    int err = 0;
+    TPCHANSTATS local;
+
+    DPRINTK ("pcan_ioctl_rt(PCAN_GET_CHAN_STATS)\n");
+
+    local = pcan_ioctl_chan_stats_common (ctx->dev);
+    local.dwTxExpiredPath = ctx->dwTxExpired;
+    local.dwTxEchoLostPath = ctx->dwEchoLost;
+
+    if (copy_to_user_rt (user_info, stats, &local, sizeof (local)))
+        err = -EFAULT;
+
+    return err;
+}
+
+/* is called at user ioctl() with cmd = PCAN_GET_LOCK_STATS */
+int
+pcan_ioctl_lock_stats_rt (rtdm_user_info_t * user_info, struct pcanctx_rt *ctx, TPLOCKSTATS * stats)
+{
+    int err = 0;
+    TPLOCKSTATS local;
+
+    DPRINTK ("pcan_ioctl_rt(PCAN_GET_LOCK_STATS)\n");
+
+    local = pcan_ioctl_lock_stats_common (ctx->dev);
+
+    if (copy_to_user_rt (user_info, stats, &local, sizeof (local)))
+        err = -EFAULT;
+
+    return err;
+}
+
 /* is called at user ioctl() with cmd = PCAN_INIT */
 int
 pcan_ioctl_init_rt (rtdm_user_info_t * user_info, struct pcanctx_rt *ctx, TPCANInit * Init)
@@ -366,32 +817,41 @@ pcan_ioctl_init_rt (rtdm_user_info_t * user_info, struct pcanctx_rt *ctx, TPCANI
     int err = 0;
     TPCANInit local;
     struct pcandev *dev;
-    rtdm_lockctx_t lockctx;
 
     DPRINTK ("pcan_ioctl_rt(PCAN_INIT)\n");
 
     dev = ctx->dev;
 
     if (copy_from_user_rt (user_info, &local, Init, sizeof (local)))
+        return -EFAULT;
+
+    /* one PCAN_INIT at a time, the settings are compared and taken over in several steps */
+    if (atomic_cmpxchg (&dev->InitBusy, 0, 1))
+        return -EBUSY;
+
+    /* change only what differs, queued frames survive as long as the bitrate is kept,
+     * the fifos are flushed by the chip while in reset mode otherwise; the device
+     * takes the new settings over together with the chip mode */
+    err = dev->device_reconfigure (dev, local.wBTR0BTR1, local.ucCANMsgType, local.ucListenOnly);
+    if (!err)
     {
-        err = -EFAULT;
+        pcan_tx_watchdog_start (dev);
+
+        /* the transmitter is only handed back if reset mode cut off its frame,
+         * which is sent again now */
+        err = pcan_push_write_rt (dev);
+
         goto fail;
     }
 
-    /* flush fifo contents */
-    rtdm_lock_get_irqsave (&ctx->out_lock, lockctx);
-    err = pcan_fifo_reset (&dev->writeFifo);
-    rtdm_lock_put_irqrestore (&ctx->out_lock, lockctx);
-    if (err)
-        goto fail;
+    DPRINTK ("pcan_ioctl_init_rt() falls back to a full init (%d)\n", err);
 
-    rtdm_lock_get_irqsave (&ctx->in_lock, lockctx);
-    err = pcan_fifo_reset (&dev->readFifo);
-    rtdm_lock_put_irqrestore (&ctx->in_lock, lockctx);
+    /* flush fifo contents */
+    err = pcan_flush_fifos_rt (dev);
     if (err)
         goto fail;
 
-    wait_until_fifo_empty (dev, MAX_WAIT_UNTIL_CLOSE, ctx);
+    wait_until_fifo_empty (dev, MAX_WAIT_UNTIL_CLOSE);
 
     /* release the device */
     dev->device_release (dev);
@@ -399,13 +859,10 @@ pcan_ioctl_init_rt (rtdm_user_info_t * user_info, struct pcanctx_rt *ctx, TPCANI
     /* init again */
     err = dev->device_open (dev, local.wBTR0BTR1, local.ucCANMsgType, local.ucListenOnly);
     if (!err)
-    {
-        dev->wBTR0BTR1 = local.wBTR0BTR1;
-        dev->ucCANMsgType = local.ucCANMsgType;
-        dev->ucListenOnly = local.ucListenOnly;
-    }
+        pcan_tx_watchdog_start (dev);
 
   fail:
+    atomic_set (&dev->InitBusy, 0);
     return err;
 }
 
@@ -487,9 +944,36 @@ pcan_ioctl_rt (struct rtdm_dev_context *context, rtdm_user_info_t * user_info,
     case PCAN_READ_MSG:
         err = pcan_ioctl_read_rt (user_info, ctx, (TPCANRdMsg *) arg);  /* support blocking and nonblocking IO */
         break;
+    case PCAN_READ_MSG_NS:
+        err = pcan_ioctl_read_ns_rt (user_info, ctx, (TPCANRdMsgNs *) arg);
+        break;
+    case PCAN_READ_MSGS_NS:
+        err = pcan_ioctl_read_msgs_ns_rt (user_info, ctx, (TPCANRdMsgsNs *) arg);
+        break;
     case PCAN_WRITE_MSG:
         err = pcan_ioctl_write_rt (user_info, ctx, (TPCANMsg *) arg);   /* support blocking and nonblocking IO */
         break;
+    case PCAN_WRITE_MSG_EX:
+        err = pcan_ioctl_write_ex_rt (user_info, ctx, (TPCANWrMsg *) arg);
+        break;
+    case PCAN_SET_SHAPER:
+        err = pcan_ioctl_set_shaper_rt (user_info, ctx, (TPSHAPER *) arg);
+        break;
+    case PCAN_SET_CYCLIC:
+        err = pcan_ioctl_set_cyclic_rt (user_info, ctx, (TPCYCLIC *) arg);
+        break;
+    case PCAN_SET_TX_REFERENCE:
+        err = pcan_ioctl_set_tx_reference_rt (user_info, ctx, (TPTXREF *) arg);
+        break;
+    case PCAN_SET_TX_SLOT:
+        err = pcan_ioctl_set_tx_slot_rt (user_info, ctx, (TPTXSLOT *) arg);
+        break;
+    case PCAN_READ_TX_REPORT:
+        err = pcan_ioctl_read_tx_report_rt (user_info, ctx, (TPTXREPORT *) arg);
+        break;
+    case PCAN_READ_ECHO:
+        err = pcan_ioctl_read_echo_rt (user_info, ctx, (TPCANEcho *) arg);
+        break;
     case PCAN_GET_EXT_STATUS:
         err = pcan_ioctl_extended_status_rt (user_info, ctx, (TPEXTENDEDSTATUS *) arg);
         break;
@@ -499,6 +983,12 @@ pcan_ioctl_rt (struct rtdm_dev_context *context, rtdm_user_info_t * user_info,
     case PCAN_DIAG:
         err = pcan_ioctl_diag_rt (user_info, ctx, (TPDIAG *) arg);
         break;
+    case PCAN_GET_CHAN_STATS:
+        err = pcan_ioctl_chan_stats_rt (user_info, ctx, (TPCHANSTATS *) arg);
+        break;
+    case PCAN_GET_LOCK_STATS:
+        err = pcan_ioctl_lock_stats_rt (user_info, ctx, (TPLOCKSTATS *) arg);
+        break;
     case PCAN_INIT:
         err = pcan_ioctl_init_rt (user_info, ctx, (TPCANInit *) arg);
         break;
@@ -38,6 +38,7 @@
 #include <adlink_pci.h>
 #include <adlink_fops.h>
 #include <adlink_fifo.h>
+#include <adlink_txq.h>
 #include <adlink_filter.h>
 
 /**
@@ -139,25 +140,26 @@ rt_remove_dev_list (void)
     remove_dev_list ();
 }
 
+/* a frame made by the driver itself goes into the read fifo as it is */
 int
-pcan_chardev_rx (struct pcandev *dev, struct can_frame *cf, struct timeval *tv)
+pcan_chardev_rx (struct pcandev *dev, struct can_frame *cf, nanosecs_abs_t qwTimestamp,
+                 nanosecs_abs_t qwSofTimestamp)
 {
     int result = 0;
 
     /* filter out extended messages in non extended mode */
     if (dev->bExtended || !(cf->can_id & CAN_EFF_FLAG))
     {
-        TPCANRdMsg msg;
-        struct timeval tr;
-        get_relative_time (tv, &tr);
-        timeval2pcan (&tr, &msg.dwTime, &msg.wUsec);
+        RX_IMAGE img;
 
-        /* convert to old style FIFO message until FIFO supports new
-         * struct can_frame and error frames */
-        frame2msg (cf, &msg.Msg);
+        /* keep the raw clock value, conversion is left to the reader */
+        img.qwTimestamp = qwTimestamp;
+        img.qwSofTimestamp = qwSofTimestamp;
+        img.ucKind = RX_IMAGE_FRAME;
+        img.u.frame = *cf;
 
         /* step forward in fifo */
-        result = pcan_fifo_put (&dev->readFifo, &msg);
+        result = pcan_fifo_put (&dev->readFifo, &img);
 
         /* flag to higher layers that a message was put into fifo or an error occurred */
         result = (result) ? result : 1;
@@ -166,6 +168,25 @@ pcan_chardev_rx (struct pcandev *dev, struct can_frame *cf, struct timeval *tv)
     return result;
 }
 
+/* a receive buffer image goes into the read fifo verbatim, the reader decodes it */
+int
+pcan_chardev_rx_image (struct pcandev *dev, u8 * image, nanosecs_abs_t qwTimestamp,
+                       nanosecs_abs_t qwSofTimestamp)
+{
+    RX_IMAGE img;
+    int result;
+
+    /* the format is only known to the chip driver, which filters extended frames itself */
+    img.qwTimestamp = qwTimestamp;
+    img.qwSofTimestamp = qwSofTimestamp;
+    img.ucKind = RX_IMAGE_RAW;
+    memcpy (img.u.ucImage, image, IRQ_IMAGE_SIZE);
+
+    result = pcan_fifo_put (&dev->readFifo, &img);
+
+    return (result) ? result : 1;
+}
+
 /* end of real time functions */
 
 /* convert struct can_frame to struct TPCANMsg
@@ -181,6 +202,17 @@ frame2msg (struct can_frame *cf, TPCANMsg * msg)
         msg->MSGTYPE = MSGTYPE_STATUS;
         msg->LEN = 4;
 
+        /* the SocketCAN description of the error around the PCAN status in DATA[3] */
+        msg->ID = cf->can_id & CAN_ERR_MASK;
+        if (cf->can_id & (CAN_ERR_LOSTARB | CAN_ERR_PROT | CAN_ERR_CNT))
+        {
+            msg->LEN = 8;
+            memcpy (&msg->DATA[0], &cf->data[0], 3);
+            msg->DATA[5] = cf->data[3];
+            msg->DATA[6] = cf->data[6];
+            msg->DATA[7] = cf->data[7];
+        }
+
         if (cf->can_id & CAN_ERR_CRTL)
         {
             /* handle data overrun */
@@ -235,58 +267,36 @@ msg2frame (struct can_frame *cf, TPCANMsg * msg)
     memcpy (&cf->data[0], &msg->DATA[0], 8);    /* also copy trailing zeros */
 }
 
-/* request time in msec, fast */
-u32
-get_mtime (void)
+/* make a message out of an entry of the read fifo, in the context of the reader */
+void
+pcan_rx_decode (struct pcandev *dev, RX_IMAGE * img, TPCANRdMsgNs * msg)
 {
-    return (jiffies / HZ) * 1000;
-}
+    struct can_frame cf;
 
-/* x = (x >= y) ? x - y : 0; */
-static void
-subtract_timeval (struct timeval *x, struct timeval *y)
-{
-    if (x->tv_usec >= y->tv_usec)
-        x->tv_usec -= y->tv_usec;
-    else
-    {
-        if (x->tv_sec)
-        {
-            x->tv_sec--;
-            x->tv_usec += (1000000 - y->tv_usec);
-        }
-        else
-            goto fail;
-    }
+    msg->qwTimestamp = img->qwTimestamp;
+    msg->qwSofTimestamp = img->qwSofTimestamp;
 
-    if (x->tv_sec >= y->tv_sec)
+    if (img->ucKind == RX_IMAGE_RAW)
     {
-        x->tv_sec -= y->tv_sec;
-        return;
+        dev->device_decode (img->u.ucImage, &cf);
+        frame2msg (&cf, &msg->Msg);
     }
-
-  fail:
-    x->tv_sec = x->tv_usec = 0;
+    else
+        frame2msg (&img->u.frame, &msg->Msg);
 }
 
-/* get relative time to start of driver */
+/* convert a rtdm_clock_read() timestamp into pcan's msec / usec notation relative to driver start */
 void
-get_relative_time (struct timeval *tv, struct timeval *tr)
+ns2pcan (nanosecs_abs_t qwTimestamp, u32 * msecs, u16 * usecs)
 {
-    if (!tv)
-        DO_GETTIMEOFDAY ((*tr));
-    else
-        memcpy (tr, tv, sizeof (*tr));
+    u64 usec = 0;
 
-    subtract_timeval (tr, &pcan_drv.sInitTime);
-}
+    if (qwTimestamp > pcan_drv.qwInitTime)
+        usec = qwTimestamp - pcan_drv.qwInitTime;
 
-/* convert timeval to pcan used milliseconds / microseconds notation */
-void
-timeval2pcan (struct timeval *tv, u32 * msecs, u16 * usecs)
-{
-    *msecs = (u32) (tv->tv_sec * 1000 + tv->tv_usec / 1000);
-    *usecs = (u16) (tv->tv_usec % 1000);
+    do_div (usec, 1000);
+    *usecs = (u16) do_div (usec, 1000);
+    *msecs = (u32) usec;
 }
 
 /* is called when 'cat /proc/pcan' invoked */
@@ -336,7 +346,7 @@ pcan_read_procmem (char *page, char **start, off_t offset, int count, int *eof,
                         wIrq,
                         dev->wBTR0BTR1,
                         (unsigned long) dev->readFifo.dwTotal,
-                        (unsigned long) dev->writeFifo.dwTotal,
+                        (unsigned long) pcan_tx_total (dev),
                         dev->dwInterruptCounter, dev->dwErrorCounter, dev->wCANStatus);
     }
 
@@ -402,6 +412,45 @@ pcan_soft_init (struct pcandev *dev, char *szType, u16 wType)
     dev->busStatus = CAN_ERROR_ACTIVE;
     dev->dwErrorCounter = 0;
     dev->dwInterruptCounter = 0;
+    dev->dwResetSwitchNs = 0;
+    dev->dwResetSwitchMaxNs = 0;
+    dev->dwNormalSwitchNs = 0;
+    dev->dwNormalSwitchMaxNs = 0;
+    dev->dwSwitchTimeouts = 0;
+    dev->dwReconfigResetNs = 0;
+    dev->dwReconfigResetMaxNs = 0;
+    dev->dwIrqHandled = 0;
+    dev->dwIrqForeign = 0;
+    dev->dwIsrCount = 0;
+    dev->dwIsrMaxNs = 0;
+    dev->qwIsrTotalNs = 0;
+    dev->dwTxRequests = 0;
+    dev->dwTxDirect = 0;
+    dev->dwTxLatencyMaxNs = 0;
+    dev->qwTxLatencyTotalNs = 0;
+    dev->dwTxAborts = 0;
+    dev->dwTxShaped = 0;
+    dev->dwTxStallRecoveries = 0;
+    dev->dwTxWatchdogSeen = 0;
+    dev->ucTxStallSuspect = 0;
+    dev->dwTxCyclicLost = 0;
+    dev->dwTxReferences = 0;
+    dev->dwTxSlotLost = 0;
+    dev->dwTxCollapsed = 0;
+    dev->dwTxExpired = 0;
+    dev->wTxExpiredReports = 0;
+    dev->wLastCtxId = 0;
+    dev->dwTxSingleShotFailed = 0;
+    dev->dwTxReportsLost = 0;
+    dev->dwBitErrors = 0;
+    dev->dwFormErrors = 0;
+    dev->dwStuffErrors = 0;
+    dev->dwOtherErrors = 0;
+    dev->dwAckErrors = 0;
+    dev->dwCrcErrors = 0;
+    dev->dwTxBusErrors = 0;
+    dev->dwArbitLost = 0;
+    dev->dwStageOverruns = 0;
     dev->wCANStatus = 0;
     dev->bExtended = 1;         /* accept all frames */
     dev->wBTR0BTR1 = bitrate;
@@ -413,7 +462,14 @@ pcan_soft_init (struct pcandev *dev, char *szType, u16 wType)
     /* set default access functions */
     dev->device_open = NULL;
     dev->device_release = NULL;
+    dev->device_reconfigure = NULL;
     dev->device_write = NULL;
+    dev->device_decode = NULL;
+    dev->device_marshal = NULL;
+    dev->device_write_image = NULL;
+    dev->device_preempt = NULL;
+    dev->device_tx_watchdog = NULL;
+    dev->device_error_counters = NULL;
     dev->cleanup = NULL;
 
     dev->device_params = NULL;  /* the default */
@@ -422,15 +478,47 @@ pcan_soft_init (struct pcandev *dev, char *szType, u16 wType)
     dev->ucActivityState = ACTIVITY_NONE;
 
     atomic_set (&dev->DataSendReady, 1);
+    atomic_set (&dev->InitBusy, 0);
 
     /* init fifos */
     pcan_fifo_init (&dev->readFifo, &dev->rMsg[0], &dev->rMsg[READ_MESSAGE_COUNT - 1],
-                    READ_MESSAGE_COUNT, sizeof (TPCANRdMsg));
-    pcan_fifo_init (&dev->writeFifo, &dev->wMsg[0], &dev->wMsg[WRITE_MESSAGE_COUNT - 1],
-                    WRITE_MESSAGE_COUNT, sizeof (TPCANMsg));
-
-    INIT_LOCK (&dev->wlock);
-    INIT_LOCK (&dev->isr_lock);
+                    READ_MESSAGE_COUNT, sizeof (RX_IMAGE));
+    memset (&dev->txShaper, 0, sizeof (dev->txShaper));
+    dev->ucShapers = 0;
+    dev->qwTxTimerDue = 0;
+    rtdm_timer_init (&dev->tx_timer, pcan_tx_timer_rt, "adlink_tx");
+    memset (dev->txCyclic, 0, sizeof (dev->txCyclic));
+    rtdm_lock_init (&dev->cyclic_lock);
+    rtdm_timer_init (&dev->cyclic_timer, pcan_cyclic_timer_rt, "adlink_cyclic");
+    rtdm_timer_init (&dev->wd_timer, pcan_tx_watchdog_rt, "adlink_wd");
+    memset (dev->txSlot, 0, sizeof (dev->txSlot));
+    dev->ucSlots = 0;
+    dev->ucRefActive = 0;
+    dev->ucTxKick = 0;
+    rtdm_lock_init (&dev->mbox_lock);
+    pcan_tx_reset (dev);
+    dev->ucTxBusError = 0;
+    dev->ucTxArbitLost = 0;
+    pcan_fifo_init (&dev->reportFifo, &dev->txReport[0], &dev->txReport[TX_REPORT_COUNT - 1],
+                    TX_REPORT_COUNT, sizeof (TPTXREPORT));
+    rtdm_lock_init (&dev->report_lock);
+    rtdm_event_init (&dev->report_event, 0);
+
+    /* IPC initialisation - cannot fail with used parameters */
+    rtdm_event_init (&dev->out_event, 1);
+    rtdm_event_init (&dev->empty_event, 1);
+    pcan_lock_init (&dev->chip_lock);
+    pcan_lock_init (&dev->rx_lock);
+    rtdm_lock_init (&dev->ctx_lock);
+    INIT_LIST_HEAD (&dev->ctx_list);
+
+    /* threaded interrupt handling, started at request of the interrupt */
+    dev->ucThreaded = 0;
+    dev->ucLostIrqStatus = 0;
+    dev->dwStageOverruns = 0;
+    rtdm_event_init (&dev->irq_event, 0);
+    pcan_fifo_init (&dev->irqFifo, &dev->irqImage[0], &dev->irqImage[IRQ_STAGE_COUNT - 1],
+                    IRQ_STAGE_COUNT, sizeof (IRQ_IMAGE));
 }
 
 /* called when device is installed (insmod adlink.ko) */
@@ -441,7 +529,7 @@ init_module (void)
 
     memset (&pcan_drv, 0, sizeof (pcan_drv));
     pcan_drv.wInitStep = 0;
-    DO_GETTIMEOFDAY (pcan_drv.sInitTime);       /* store time for timestamp relation, increments in usec */
+    pcan_drv.qwInitTime = rtdm_clock_read ();  /* store time for timestamp relation, increments in nsec */
     pcan_drv.nMajor = PCAN_MAJOR;
 
 #if defined(__BIG_ENDIAN)
@@ -38,10 +38,17 @@
 #define CAN_ERR_BUSOFF_NETDEV CAN_ERR_BUSOFF
 #undef CAN_ERR_BUSOFF
 
+/* older can/error.h lack the error counters in data[6] and data[7] */
+#ifndef CAN_ERR_CNT
+#define CAN_ERR_CNT 0x00000200U
+#endif
+
 #include <rtdm/rtdm_driver.h>
 struct pcanctx_rt;
+struct pcan_pci_card;
 
 #include <pcan.h>
+#include <adlink.h>
 
 /* Defines */
 #define CHANNEL_SINGLE 0
@@ -52,7 +59,15 @@ struct pcanctx_rt;
 #define WRITEBUFFER_SIZE     80
 #define PCAN_MAJOR            0 /* use dynamic major allocation, else use 91 */
 #define READ_MESSAGE_COUNT  500 /* read and write message count */
-#define WRITE_MESSAGE_COUNT  50
+#define WRITE_MESSAGE_COUNT  64 /* a power of 2 */
+#define TX_MAILBOXES         32 /* frames written with PCAN_WR_LATEST, not sent yet */
+#define TX_REPORT_COUNT      64 /* outcomes of transmissions not read yet */
+#define ECHO_COUNT           32 /* echoes not read yet, per context */
+
+#define IRQ_STAGE_COUNT     16  /* interrupts staged for the service task */
+#define IRQ_STAGE_FRAMES     9  /* frames read out in one interrupt at most */
+#define IRQ_IMAGE_SIZE      13  /* frame info, identifier and data as in the receive buffer */
+#define FRAME_BITS_MAX     160  /* longest possible frame: 8 data bytes, 29 bit identifier, worst case stuffing */
 
 /* wBTR0BTR1 parameter - bitrate of BTR0/BTR1 registers */
 #define CAN_BAUD_1M     0x0014
@@ -98,13 +113,120 @@ typedef struct
     void *bufferBegin;          /* points to first element */
     void *bufferEnd;            /* points to last element */
     u32 nCount;                 /* max counts of elements in fifo */
-    u32 nStored;                /* count of currently stored messages */
+    volatile u32 dwPut;         /* count of stored messages, written by the producer only */
+    volatile u32 dwGet;         /* count of taken messages, written by the consumer only */
     u32 dwTotal;                /* received messages */
-    void *r;                    /* nest Msg to read into the read buffer */
-    void *w;                    /* next Msg to write into the read buffer */
-    spinlock_t lock;            /* mutual exclusion lock */
+    void *r;                    /* nest Msg to read into the read buffer, consumer only */
+    void *w;                    /* next Msg to write into the read buffer, producer only */
 } FIFO_MANAGER;
 
+/* the chip's state captured in the interrupt, for later processing */
+typedef struct
+{
+    nanosecs_abs_t qwTimestamp; /* rtdm_clock_read() at entry of the interrupt */
+    u8 ucIrqStatus;             /* INTERRUPT_STATUS */
+    u8 ucChipStatus;            /* CHIPSTATUS, read for error interrupts only */
+    u8 ucErrorCode;             /* ERROR_CODE_CAPTURE, read for bus error interrupts only */
+    u8 ucArbitLost;             /* ARBIT_LOST_CAPTURE, read for arbitration lost interrupts only */
+    u8 ucRxErrors;              /* RX_ERROR_COUNTER, read for error interrupts only */
+    u8 ucTxErrors;              /* TX_ERROR_COUNTER, read for error interrupts only */
+    u8 ucFrames;                /* count of valid images */
+    u8 ucImage[IRQ_STAGE_FRAMES][IRQ_IMAGE_SIZE];       /* receive buffer contents */
+} IRQ_IMAGE;
+
+/* a frame to send as kept in the write fifo, ready to be copied into the transmit buffer */
+typedef struct
+{
+    nanosecs_abs_t qwQueued;    /* rtdm_clock_read() when the writer handed the frame over */
+    nanosecs_abs_t qwLaunch;    /* rtdm_clock_read() to load the frame into the transmit buffer at, 0 for now */
+    canid_t dwId;               /* identifier and flags of the frame */
+    u16 wBits;                  /* estimated length on the bus */
+    nanosecs_abs_t qwDeadline;  /* rtdm_clock_read() after which the frame is dropped unsent, 0 for never */
+    u16 wCtxId;                 /* the path which wrote the frame, 0 for the driver itself */
+    u32 dwTag;                  /* handed back with the echo */
+    u8 ucFlags;                 /* PCAN_WR_... */
+    u8 ucClass;                 /* transmit priority class, PCAN_TX_... */
+    u8 ucLen;                   /* count of valid bytes in ucImage */
+    u8 ucImage[IRQ_IMAGE_SIZE]; /* frame info, identifier and data as in the transmit buffer */
+} TX_IMAGE;
+
+/* one entry of the transmit queue */
+typedef struct
+{
+    atomic_t nSeq;              /* the position the cell is free or filled at */
+    TX_IMAGE img;
+} TXQ_CELL;
+
+/* the transmit queue, filled by any number of writers and emptied by whoever holds the chip */
+typedef struct
+{
+    atomic_t nEnqueue;          /* next position to claim by a writer */
+    volatile u32 dwDequeue;     /* next position to take, written by the consumer only */
+    u32 dwTotal;                /* transmitted messages */
+    TXQ_CELL cell[WRITE_MESSAGE_COUNT];
+} TX_QUEUE;
+
+/* a token bucket limiting a part of the transmitted frames, kept as the time it is refilled up to */
+typedef struct
+{
+    u8 ucClass;                 /* the class shaped, PCAN_TX_CLASSES for all */
+    u8 ucUnit;                  /* PCAN_SHAPE_FRAMES or PCAN_SHAPE_BITS */
+    u8 ucIdType;                /* PCAN_SHAPE_ANY_ID, PCAN_SHAPE_STD_ID or PCAN_SHAPE_EXT_ID */
+    u32 dwFromID;               /* identifier range shaped */
+    u32 dwToID;
+    u32 dwIntervalNs;           /* time to earn one token, 0 if disabled */
+    nanosecs_abs_t qwTolerance; /* size of the bucket expressed as time */
+    nanosecs_abs_t qwTat;       /* the bucket holds no tokens until then, it is full at qwTat - qwTolerance */
+} TX_SHAPER;
+
+/* a frame sent periodically */
+typedef struct
+{
+    nanosecs_abs_t qwPeriod;    /* 0 if the job is not active */
+    nanosecs_abs_t qwNext;      /* time of the next transmission */
+    u32 dwCount;                /* transmissions left, 0 for endless */
+    TX_IMAGE img;               /* the frame, marshalled */
+} TX_CYCLIC;
+
+/* the latest contents of a frame written with PCAN_WR_LATEST; its place in the
+ * queue is held by a token, an image of length 0 carrying the mailbox index */
+typedef struct
+{
+    u8 ucPending;               /* a token is queued, the frame was not sent yet */
+    TX_IMAGE img;               /* the frame, marshalled */
+} TX_MAILBOX;
+
+/* a frame sent at a fixed offset from the reference frame */
+typedef struct
+{
+    nanosecs_abs_t qwOffset;    /* launch time after the start of the reference frame */
+    u8 ucActive;                /* the slot is part of the transmit matrix */
+    TX_IMAGE img;               /* the frame, marshalled */
+} TX_SLOT;
+
+/* states of txCurrent, the frame last loaded into the transmit buffer */
+#define TX_IDLE     0           /* txCurrent is done with */
+#define TX_BUSY     1           /* txCurrent occupies the transmit buffer */
+#define TX_ABORTING 2           /* an abort was requested in favour of a more urgent frame */
+#define TX_REQUEUED 3           /* txCurrent was aborted, it is sent again ahead of its class */
+
+/* kinds of entries in the read fifo */
+#define RX_IMAGE_RAW   0        /* a receive buffer image, decoded by the reader */
+#define RX_IMAGE_FRAME 1        /* a frame made by the driver itself, e.g. an error frame */
+
+/* a received frame as kept in the read fifo */
+typedef struct
+{
+    nanosecs_abs_t qwTimestamp; /* rtdm_clock_read() at entry of the receiving interrupt */
+    nanosecs_abs_t qwSofTimestamp;      /* start of frame, reconstructed from bit timing and frame length */
+    u8 ucKind;                  /* RX_IMAGE_RAW or RX_IMAGE_FRAME */
+    union
+    {
+        u8 ucImage[IRQ_IMAGE_SIZE];     /* receive buffer contents, verbatim */
+        struct can_frame frame; /* the ready made frame */
+    } u;
+} RX_IMAGE;
+
 typedef struct
 {
     u32 dwPort;                 /* the port of the transport layer */
@@ -114,6 +236,8 @@ typedef struct
     u16 wIrq;                   /* the associated irq level */
     int nChannel;               /* associated channel of the card - channel #0 is special */
     struct pci_dev *pciDev;     /* remember the hosting PCI card */
+    struct pcan_pci_card *card; /* resources shared with the other channel */
+    u16 wPitaMask;              /* the channel's bit in PITA_ICR */
 } PCI_PORT;
 
 typedef struct pcandev
@@ -142,12 +266,19 @@ typedef struct pcandev
     int (*cleanup) (struct pcandev * dev);      /* cleanup the interface */
     int (*open) (struct pcandev * dev); /* called at open of a path */
     int (*release) (struct pcandev * dev);      /* called at release of a path */
-    int (*req_irq) (struct rtdm_dev_context * context); /* install the interrupt handler */
+    int (*req_irq) (struct pcandev * dev);      /* install the interrupt handler */
     void (*free_irq) (struct pcandev * dev);    /* release the interrupt */
 
     int (*device_open) (struct pcandev * dev, u16 btr0btr1, u8 bExtended, u8 bListenOnly);      /* open the device itself */
     void (*device_release) (struct pcandev * dev);      /* release the device itself */
-    int (*device_write) (struct pcandev * dev, struct pcanctx_rt * ctx);        /* write the device */
+    int (*device_reconfigure) (struct pcandev * dev, u16 btr0btr1, u8 bExtended, u8 bListenOnly);        /* change settings of the opened device */
+    int (*device_write) (struct pcandev * dev); /* write the device */
+    void (*device_decode) (u8 * image, struct can_frame * cf); /* make a frame out of a receive buffer image */
+    void (*device_marshal) (struct can_frame * cf, TX_IMAGE * img);     /* make the transmit buffer image of a frame */
+    int (*device_write_image) (struct pcandev * dev, TX_IMAGE * img);   /* write a frame if the transmitter is free */
+    void (*device_preempt) (struct pcandev * dev, u8 ucClass);  /* abort a less urgent frame being sent */
+    int (*device_tx_watchdog) (struct pcandev * dev);   /* recover a transmitter without progress */
+    void (*device_error_counters) (struct pcandev * dev, u8 * ucRxErrors, u8 * ucTxErrors);     /* read the error counters */
 
     int (*device_params) (struct pcandev * dev, TPEXTRAPARAMS * params);        /* a generalized interface to set */
     /* or get special parameters from the device */
@@ -160,22 +291,102 @@ typedef struct pcandev
     int busStatus;              /* follows error status of CAN-Bus */
     u32 dwErrorCounter;         /* counts all fatal errors */
     u32 dwInterruptCounter;     /* counts all interrupts */
+    u32 dwResetSwitchNs;        /* duration of the last switch into reset mode */
+    u32 dwResetSwitchMaxNs;     /* longest switch into reset mode */
+    u32 dwNormalSwitchNs;       /* duration of the last switch back into operating mode */
+    u32 dwNormalSwitchMaxNs;    /* longest switch back into operating mode */
+    u32 dwSwitchTimeouts;       /* mode switches which did not complete in time */
+    u32 dwReconfigResetNs;      /* time the last reconfiguration spent in reset mode */
+    u32 dwReconfigResetMaxNs;   /* longest time a reconfiguration spent in reset mode */
+    u32 dwIrqHandled;           /* interrupts raised by this channel */
+    u32 dwIrqForeign;           /* interrupts on the shared line raised by others */
+    u32 dwIsrCount;             /* runs of the interrupt handler which found work */
+    u32 dwIsrMaxNs;             /* time spent in the interrupt handler */
+    u64 qwIsrTotalNs;
+    u32 dwTxRequests;           /* transmissions requested at the chip */
+    u32 dwTxDirect;             /* transmissions requested by the write ioctl itself */
+    u32 dwTxLatencyMaxNs;       /* longest time from the write ioctl to the transmission request */
+    u64 qwTxLatencyTotalNs;     /* sum of the times from the write ioctl to the transmission request */
+    u32 dwTxAborts;             /* frames aborted in favour of more urgent ones */
+    u32 dwTxShaped;             /* times the transmitter was left idle to keep a rate or a launch time */
+    u32 dwTxStallRecoveries;    /* times the transmit watchdog kicked a stalled transmitter */
+    u32 dwTxWatchdogSeen;       /* dwTxRequests at the last run of the transmit watchdog */
+    u8 ucTxStallSuspect;        /* the last run of the transmit watchdog found a stall */
+    u32 dwTxCyclicLost;         /* cyclic frames dropped for a full transmit queue */
+    u32 dwTxReferences;         /* reference frames received while the transmit matrix was active */
+    u32 dwTxSlotLost;           /* slot frames dropped for a full transmit queue */
+    u32 dwTxCollapsed;          /* frames replaced by a newer one of the same ID before being sent */
+    u32 dwTxExpired;            /* frames dropped unsent past their deadline */
+    u16 wTxExpiredReports;      /* error frames for expired frames left to irq_task */
+    u16 wLastCtxId;             /* the id given to the last opened context */
+    u32 dwTxSingleShotFailed;   /* single shot frames not sent */
+    u32 dwTxReportsLost;        /* transmit reports dropped for a full reportFifo */
+    u32 dwBitErrors;            /* bus errors by the type in ERROR_CODE_CAPTURE */
+    u32 dwFormErrors;
+    u32 dwStuffErrors;
+    u32 dwOtherErrors;
+    u32 dwAckErrors;            /* bus errors in the acknowledge slot or delimiter */
+    u32 dwCrcErrors;            /* bus errors in the CRC sequence or delimiter */
+    u32 dwTxBusErrors;          /* bus errors while transmitting */
+    u32 dwArbitLost;            /* arbitration lost interrupts */
     u16 wCANStatus;             /* status of CAN chip */
     u16 wBTR0BTR1;              /* the persistent storage for BTR0 and BTR1 */
+    u32 dwBitTimeNs;            /* nominal bit time in nsec belonging to wBTR0BTR1 */
     u8 ucCANMsgType;            /* the persistent storage for 11 or 29 bit identifier */
-    u8 ucListenOnly;            /* the persistent storage for listen-only mode */
+    u8 ucListenOnly;            /* the persistent storage for listen-only mode, PCAN_INIT_... */
+    u8 ucTxRequest;             /* command to start a transmission with, depends on the mode */
+    u8 ucIrqEnable;             /* interrupts enabled while operating, depends on the mode */
     u8 ucPhysicallyInstalled;   /* the device is PhysicallyInstalled */
     u8 ucActivityState;         /* follow the state of a channel activity */
     atomic_t DataSendReady;     /* !=0 if all data are send */
+    atomic_t InitBusy;          /* !=0 while a PCAN_INIT is changing the settings */
 
     FIFO_MANAGER readFifo;      /* manages the read fifo */
-    FIFO_MANAGER writeFifo;     /* manages the write fifo */
-    TPCANRdMsg rMsg[READ_MESSAGE_COUNT];        /* all read messages */
-    TPCANMsg wMsg[WRITE_MESSAGE_COUNT]; /* all write messages */
+    RX_IMAGE rMsg[READ_MESSAGE_COUNT];  /* all read messages */
+    TX_QUEUE txq[PCAN_TX_CLASSES];      /* all write messages, by priority class */
+    TX_IMAGE txCurrent;         /* copy of the frame last loaded into the transmit buffer */
+    u8 ucTxState;               /* TX_IDLE, TX_BUSY, TX_ABORTING or TX_REQUEUED */
+    u8 ucTxBusError;            /* a bus error occurred while a single shot frame was loaded */
+    u8 ucTxErrorCode;           /* ERROR_CODE_CAPTURE of that bus error */
+    u8 ucTxArbitLost;           /* an arbitration lost interrupt occurred while a single shot frame was loaded */
+    u8 ucTxArbitBit;            /* the bit position captured by that interrupt */
+    FIFO_MANAGER reportFifo;    /* outcomes of transmissions, filled under chip_lock */
+    TPTXREPORT txReport[TX_REPORT_COUNT];       /* all transmit reports */
+    rtdm_lock_t report_lock;    /* serializes the readers of reportFifo */
+    rtdm_event_t report_event;  /* signalled when a transmit report was put into reportFifo */
+    TX_MAILBOX txMailbox[TX_MAILBOXES]; /* frames written with PCAN_WR_LATEST */
+    rtdm_lock_t mbox_lock;      /* guards txMailbox and the queueing of their tokens */
+    TX_SHAPER txShaper[PCAN_TX_SHAPERS];        /* rate limits, changed under chip_lock */
+    u8 ucShapers;               /* count of enabled shapers */
+    nanosecs_abs_t qwTxTimerDue;        /* expiry of tx_timer, 0 if not armed */
+    rtdm_timer_t tx_timer;      /* pushes the transmitter when a held back frame gets due */
+    TX_CYCLIC txCyclic[PCAN_TX_CYCLIC]; /* frames sent periodically */
+    rtdm_lock_t cyclic_lock;    /* guards txCyclic, txSlot and txRef */
+    rtdm_timer_t cyclic_timer;  /* queues the frames of txCyclic when they get due */
+    rtdm_timer_t wd_timer;      /* the transmit watchdog, periodic while the device is open */
+    TX_SLOT txSlot[PCAN_TX_SLOTS];      /* the transmit matrix */
+    u8 ucSlotOrder[PCAN_TX_SLOTS];      /* indices of the active slots by offset */
+    u8 ucSlots;                 /* count of active slots */
+    TX_IMAGE txRef;             /* the reference frame, marshalled to compare it with received ones */
+    volatile u8 ucRefActive;    /* txRef is valid and triggers the transmit matrix, peeked at unlocked */
+    u8 ucTxKick;                /* frames were queued at reception, the transmitter has to be loaded */
     void *filter;               /* a ID filter - currently associated to device */
-    spinlock_t wlock;           /* mutual exclusion lock for write invocation */
-    spinlock_t isr_lock;        /* in isr */
-    int drvRegistered[2];       /* test if driver is registered */
+
+    rtdm_event_t out_event;     /* signalled when the write fifo accepts messages again */
+    rtdm_event_t empty_event;   /* signalled when the write fifo ran empty */
+    /* lock order: chip_lock before mbox_lock, ctx_lock, cyclic_lock and rx_lock, never the other way */
+    PCAN_LOCK chip_lock;        /* sja1000 access and the transmitter state, taken by the interrupt handler */
+    PCAN_LOCK rx_lock;          /* serializes the consumers of the read fifo */
+    rtdm_lock_t ctx_lock;       /* guards ctx_list */
+    struct list_head ctx_list;  /* all open contexts, each one is woken at reception */
+
+    u8 ucThreaded;              /* interrupts are processed by irq_task */
+    u8 ucLostIrqStatus;         /* interrupt reasons dropped for a full irqFifo */
+    u32 dwStageOverruns;        /* interrupts dropped for a full irqFifo */
+    rtdm_task_t irq_task;       /* the service task of threaded interrupt handling */
+    rtdm_event_t irq_event;     /* signalled by the top half for irq_task */
+    FIFO_MANAGER irqFifo;       /* staged interrupts, from the top half to irq_task */
+    IRQ_IMAGE irqImage[IRQ_STAGE_COUNT];        /* all staged interrupts */
 } PCANDEV;
 
 struct pcanctx_rt
@@ -189,14 +400,15 @@ struct pcanctx_rt
     u8 *pcWritePointer;         /* work pointer into buffer */
     int nWriteCount;
 
-    rtdm_irq_t irq_handle;
-    rtdm_event_t in_event;
-    rtdm_event_t out_event;
-    rtdm_event_t empty_event;
-    rtdm_lock_t in_lock;        /* read mutual exclusion lock */
-    rtdm_lock_t out_lock;       /* write mutual exclusion lock */
-    rtdm_lock_t sja_lock;       /* sja mutual exclusion lock */
-    unsigned int irq;           /* the associated irq level */
+    struct list_head list;      /* entry in the device's ctx_list */
+    rtdm_event_t in_event;      /* signalled at reception of messages */
+    u16 wCtxId;                 /* tells the frames written through this context */
+    u32 dwTxExpired;            /* frames written through this context dropped past their deadline */
+    FIFO_MANAGER echoFifo;      /* frames written through this context and sent, filled under chip_lock */
+    TPCANEcho echo[ECHO_COUNT]; /* all echoes */
+    rtdm_lock_t echo_lock;      /* serializes the readers of echoFifo */
+    rtdm_event_t echo_event;    /* signalled when an echo was put into echoFifo */
+    u32 dwEchoLost;             /* echoes dropped for a full echoFifo */
 };
 
 typedef struct driverobj
@@ -204,7 +416,7 @@ typedef struct driverobj
     int nMajor;                 /* the major number of Pcan interfaces */
     u16 wDeviceCount;           /* count of found devices */
     u16 wInitStep;              /* driver specific init state */
-    struct timeval sInitTime;   /* time in usec when init was called */
+    nanosecs_abs_t qwInitTime;  /* time in nsec when init was called */
     struct list_head devices;   /* base of list of devices */
     //    u8 *szVersionString;        /* pointer to the driver version string */
 
@@ -224,15 +436,17 @@ extern struct driverobj pcan_drv;
 extern struct list_head device_list;
 
 /* exported functions (not to kenrel) */
-u32 get_mtime (void);           /* request time in msec, fast */
-void get_relative_time (struct timeval *tv, struct timeval *tr);        /* request time from drivers start */
-void timeval2pcan (struct timeval *tv, u32 * msecs, u16 * usecs);       /* convert to pcan time */
+void ns2pcan (nanosecs_abs_t qwTimestamp, u32 * msecs, u16 * usecs);  /* convert to pcan time */
 
 void pcan_soft_init (struct pcandev *dev, char *szType, u16 wType);
 void buffer_dump (u8 * pucBuffer, u16 wLineCount);
 void frame2msg (struct can_frame *cf, TPCANMsg * msg);
 void msg2frame (struct can_frame *cf, TPCANMsg * msg);
-int pcan_chardev_rx (struct pcandev *dev, struct can_frame *cf, struct timeval *tv);
+int pcan_chardev_rx (struct pcandev *dev, struct can_frame *cf, nanosecs_abs_t qwTimestamp,
+                     nanosecs_abs_t qwSofTimestamp);
+int pcan_chardev_rx_image (struct pcandev *dev, u8 * image, nanosecs_abs_t qwTimestamp,
+                           nanosecs_abs_t qwSofTimestamp);
+void pcan_rx_decode (struct pcandev *dev, RX_IMAGE * img, TPCANRdMsgNs * msg);
 
 void dev_unregister (void);
 
@@ -21,6 +21,7 @@
 #include <adlink_common.h>      /* must always be the 1st include */
 #include <linux/errno.h>        /* error codes */
 #include <linux/kernel.h>       /* DPRINTK() */
+#include <adlink.h>
 #include <adlink_parse.h>
 
 /* helper for use in read..., makes a line of formatted output */
@@ -288,8 +289,8 @@ pcan_parse_input_init (char *buffer, TPCANInit * Init)
     Init->ucCANMsgType = 0;
     Init->ucListenOnly = 0;
 
-    /* optional rest, only 2 switches are possible */
-    for (i = 0; i < 2; i++)
+    /* optional rest, only 5 switches are possible */
+    for (i = 0; i < 5; i++)
     {
         if (skip_blanks_and_test_for_CR (&ptr))
             break;
@@ -302,7 +303,16 @@ pcan_parse_input_init (char *buffer, TPCANInit * Init)
             Init->ucCANMsgType |= MSGTYPE_EXTENDED;
             break;
         case 'l':
-            Init->ucListenOnly |= 1;
+            Init->ucListenOnly |= PCAN_INIT_LISTEN_ONLY;
+            break;
+        case 't':
+            Init->ucListenOnly |= PCAN_INIT_SELF_TEST;
+            break;
+        case 'r':
+            Init->ucListenOnly |= PCAN_INIT_SELF_RECEPTION;
+            break;
+        case 'b':
+            Init->ucListenOnly |= PCAN_INIT_ERROR_REPORTS;
             break;
         default:
             break;
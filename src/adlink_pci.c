@@ -28,7 +28,6 @@
 #include <adlink_pci.h>
 #include <adlink_sja1000.h>
 #include <adlink_filter.h>
-#include <adlink_pci_rt.c>
 
 #define PCAN_PCI_MINOR_BASE 0   /* the base of all pci device minors */
 
@@ -43,6 +42,8 @@
 #define PCI_CONFIG_PORT_SIZE 0x007f     /* size of the config io-memory */
 #define PCI_PORT_SIZE        0x007f     /* size of a channel io-memory */
 
+#include <adlink_pci_rt.c>
+
 static struct pci_device_id pcan_pci_tbl[] = {
     {ADLINK_PCI_VENDOR_ID, ADLINK_PCI_DEVICE_ID, PCI_ANY_ID, PCI_ANY_ID, 0, 0}, {0,}
 };
@@ -65,6 +66,7 @@ pcan_pci_unregister_driver (struct pci_driver *p_pci_drv)
 MODULE_DEVICE_TABLE (pci, pcan_pci_tbl);
 
 static u16 _pci_devices = 0;    /* count the number of pci devices */
+static int _pci_drv_registered = 0;     /* the pci driver was registered */
 
 static u8
 pcan_pci_readreg (struct pcandev *dev, u8 port) /* read a register */
@@ -80,53 +82,20 @@ pcan_pci_writereg (struct pcandev *dev, u8 port, u8 data)       /* write a regis
     writeb (data, dev->port.pci.pvVirtPort + lPort);
 }
 
-/* select and clear in Pita stored interrupt */
-void
-pcan_pci_clear_stored_interrupt (struct pcandev *dev)
-{
-    u16 PitaICRLow = readw (dev->port.pci.pvVirtConfigPort);    // PITA_ICR
-    switch (dev->port.pci.nChannel)
-    {
-    case 0:
-        if (PitaICRLow & 0x0002)
-            writew (0x0002, dev->port.pci.pvVirtConfigPort);
-        break;
-    case 1:
-        if (PitaICRLow & 0x0001)
-            writew (0x0001, dev->port.pci.pvVirtConfigPort);
-        break;
-    case 2:
-        if (PitaICRLow & 0x0040)
-            writew (0x0040, dev->port.pci.pvVirtConfigPort);
-        break;
-    case 3:
-        if (PitaICRLow & 0x0080)
-            writew (0x0080, dev->port.pci.pvVirtConfigPort);
-        break;
-    }
-}
-
 /* enable interrupt again */
 void
 pcan_pci_enable_interrupt (struct pcandev *dev)
 {
-    u16 PitaICRHigh = readw (dev->port.pci.pvVirtConfigPort + PITA_ICR + 2);
-    switch (dev->port.pci.nChannel)
-    {
-    case 0:
-        PitaICRHigh |= 0x0002;
-        break;                  /* bit 17 (-16 = 1) */
-    case 1:
-        PitaICRHigh |= 0x0001;
-        break;                  /* bit 16 (-16 = 0) */
-    case 2:
-        PitaICRHigh |= 0x0040;
-        break;                  /* bit 22 (-16 = 6) */
-    case 3:
-        PitaICRHigh |= 0x0080;
-        break;                  /* bit 23 (-16 = 7) */
-    }
+    struct pcan_pci_card *card = dev->port.pci.card;
+    rtdm_lockctx_t lockctx;
+    u16 PitaICRHigh;
+
+    /* the other channel of the card changes its bit in the same register */
+    rtdm_lock_get_irqsave (&card->lock, lockctx);
+    PitaICRHigh = readw (dev->port.pci.pvVirtConfigPort + PITA_ICR + 2);
+    PitaICRHigh |= dev->port.pci.wPitaMask;
     writew (PitaICRHigh, dev->port.pci.pvVirtConfigPort + PITA_ICR + 2);
+    rtdm_lock_put_irqrestore (&card->lock, lockctx);
 
     dev->wInitStep++;
 }
@@ -134,30 +103,20 @@ pcan_pci_enable_interrupt (struct pcandev *dev)
 static void
 pcan_pci_free_irq (struct pcandev *dev)
 {
+    struct pcan_pci_card *card = dev->port.pci.card;
+    rtdm_lockctx_t lockctx;
     u16 PitaICRHigh;
 
     if (dev->wInitStep == 6)
     {
         /* disable interrupt */
+        rtdm_lock_get_irqsave (&card->lock, lockctx);
         PitaICRHigh = readw (dev->port.pci.pvVirtConfigPort + PITA_ICR + 2);
-        switch (dev->port.pci.nChannel)
-        {
-        case 0:
-            PitaICRHigh &= ~0x0002;
-            break;
-        case 1:
-            PitaICRHigh &= ~0x0001;
-            break;
-        case 2:
-            PitaICRHigh &= ~0x0040;
-            break;
-        case 3:
-            PitaICRHigh &= ~0x0080;
-            break;
-        }
+        PitaICRHigh &= ~dev->port.pci.wPitaMask;
         writew (PitaICRHigh, dev->port.pci.pvVirtConfigPort + PITA_ICR + 2);
+        rtdm_lock_put_irqrestore (&card->lock, lockctx);
 
-        PCI_FREE_IRQ ();
+        pcan_pci_release_card_irq (dev);
 
         dev->wInitStep--;
     }
@@ -191,10 +150,26 @@ pcan_pci_cleanup (struct pcandev *dev)
         pcan_delete_filter_chain (dev->filter);
         dev->filter = NULL;
         dev->wInitStep = 0;
-        if ((_pci_devices == 0) && (dev->drvRegistered[0] == 1))
+
+        rtdm_event_destroy (&dev->out_event);
+        rtdm_event_destroy (&dev->empty_event);
+        rtdm_event_destroy (&dev->irq_event);
+        rtdm_event_destroy (&dev->report_event);
+        rtdm_timer_destroy (&dev->tx_timer);
+        rtdm_timer_destroy (&dev->cyclic_timer);
+        rtdm_timer_destroy (&dev->wd_timer);
+
+        /* channel #0 is cleaned up last, it takes the card with it */
+        dev->port.pci.card->dev[dev->port.pci.nChannel] = NULL;
+        if (dev->port.pci.nChannel == 0)
+            kfree (dev->port.pci.card);
+        dev->port.pci.card = NULL;
+
+        if ((_pci_devices == 0) && _pci_drv_registered)
         {
             DPRINTK("pci_devices && dev registered : true");
             pcan_pci_unregister_driver (&pcan_drv.pci_drv);
+            _pci_drv_registered = 0;
         }
     }
 
@@ -218,7 +193,7 @@ pcan_pci_release (struct pcandev *dev)
 
 static int
 pcan_pci_channel_init (struct pcandev *dev, u32 dwConfigPort, u32 dwPort, u16 wIrq,
-                       struct pcandev *master_dev)
+                       struct pcan_pci_card *card)
 {
     DPRINTK ("pcan_pci_channel_init(), _pci_devices = %d\n", _pci_devices);
 
@@ -246,6 +221,23 @@ pcan_pci_channel_init (struct pcandev *dev, u32 dwConfigPort, u32 dwPort, u16 wI
     dev->port.pci.dwConfigPort = dwConfigPort;
     dev->port.pci.wIrq = wIrq;
 
+    /* the channel's bit in both words of PITA_ICR */
+    switch (dev->port.pci.nChannel)
+    {
+    case 0:
+        dev->port.pci.wPitaMask = 0x0002;
+        break;                  /* bit 17 (-16 = 1) */
+    case 1:
+        dev->port.pci.wPitaMask = 0x0001;
+        break;                  /* bit 16 (-16 = 0) */
+    case 2:
+        dev->port.pci.wPitaMask = 0x0040;
+        break;                  /* bit 22 (-16 = 6) */
+    case 3:
+        dev->port.pci.wPitaMask = 0x0080;
+        break;                  /* bit 23 (-16 = 7) */
+    }
+
     /* reject illegal combination */
     if (!dwPort || !wIrq)
         return -EINVAL;
@@ -278,9 +270,12 @@ pcan_pci_channel_init (struct pcandev *dev, u32 dwConfigPort, u32 dwPort, u16 wI
         mdelay (5);
         writeb (0x04, dev->port.pci.pvVirtConfigPort + PITA_MISC + 3);  /* leave parport mux mode */
         wmb ();
+
+        card->pvVirtConfigPort = dev->port.pci.pvVirtConfigPort;
+        card->wIrq = wIrq;
     }
     else
-        dev->port.pci.pvVirtConfigPort = master_dev->port.pci.pvVirtConfigPort;
+        dev->port.pci.pvVirtConfigPort = card->pvVirtConfigPort;
 
     DPRINTK ("dev->port.pci.dwPort: %p\n", dev->port.pci.dwPort);
     if (check_region (dev->port.pci.dwPort, PCI_PORT_SIZE))
@@ -309,7 +304,7 @@ pcan_pci_channel_init (struct pcandev *dev, u32 dwConfigPort, u32 dwPort, u16 wI
  * create one pci based device - this may be one of multiple from a card
  */
 static int
-create_one_pci_device (struct pci_dev *pciDev, int nChannel, struct pcandev *master_dev,
+create_one_pci_device (struct pci_dev *pciDev, int nChannel, struct pcan_pci_card *card,
                        struct pcandev **dev)
 {
     struct pcandev *local_dev = NULL;
@@ -327,10 +322,17 @@ create_one_pci_device (struct pci_dev *pciDev, int nChannel, struct pcandev *mas
 
     local_dev->device_open = sja1000_open;
     local_dev->device_write = sja1000_write;
+    local_dev->device_decode = sja1000_decode_image;
+    local_dev->device_marshal = sja1000_marshal;
+    local_dev->device_write_image = sja1000_write_image;
+    local_dev->device_preempt = sja1000_preempt;
+    local_dev->device_tx_watchdog = sja1000_tx_watchdog;
+    local_dev->device_error_counters = sja1000_error_counters;
     local_dev->device_release = sja1000_release;
+    local_dev->device_reconfigure = sja1000_reconfigure;
     local_dev->port.pci.nChannel = nChannel;
     local_dev->port.pci.pciDev = NULL;
-    local_dev->drvRegistered[0] = 0;
+    local_dev->port.pci.card = card;
 
     local_dev->props.ucExternalClock = 1;
 
@@ -338,7 +340,7 @@ create_one_pci_device (struct pci_dev *pciDev, int nChannel, struct pcandev *mas
     DPRINTK ("pciDev->resource[2].start: %p\n", pciDev->resource[2].start);
     result = pcan_pci_channel_init (local_dev, (u32) pciDev->resource[1].start,
                                     (u32) pciDev->resource[2].start + nChannel * 0x0080,
-                                    (u16) pciDev->irq, master_dev);
+                                    (u16) pciDev->irq, card);
     DPRINTK ("Channel %i init result: %i\n", nChannel, result);
 
     if (!result)
@@ -354,6 +356,7 @@ create_one_pci_device (struct pci_dev *pciDev, int nChannel, struct pcandev *mas
     {
         local_dev->ucPhysicallyInstalled = 1;
         local_dev->port.pci.pciDev = pciDev;
+        card->dev[nChannel] = local_dev;
 
         list_add_tail (&local_dev->list, &pcan_drv.devices);    // add this device to the list
         pcan_drv.wDeviceCount++;
@@ -378,6 +381,7 @@ pcan_search_and_create_pci_devices (void)
     int result = 0;
     struct pcandev *dev = NULL;
     struct pcandev *master_dev = NULL;
+    struct pcan_pci_card *card;
 
     /* search pci devices */
     DPRINTK ("pcan_search_and_create_pci_devices()\n");
@@ -419,14 +423,24 @@ pcan_search_and_create_pci_devices (void)
                         goto fail;
                     wmb ();
 
-                    /* 1 channel per card */
-                    if ((result = create_one_pci_device (pciDev, 0, NULL, &dev)))
+                    /* the channels share the PITA and the interrupt */
+                    if ((card = kmalloc (sizeof (struct pcan_pci_card), GFP_KERNEL)) == NULL)
+                    {
+                        result = -ENOMEM;
+                        goto fail;
+                    }
+                    memset (card, 0, sizeof (struct pcan_pci_card));
+                    rtdm_lock_init (&card->lock);
+                    mutex_init (&card->irq_mutex);
+
+                    /* the 1st channel owns the card, its cleanup frees it */
+                    if ((result = create_one_pci_device (pciDev, 0, card, &dev)))
                         goto fail;
                     master_dev = dev;
 
                     /* add a 2nd channel per card */
-//                    if ((result = create_one_pci_device (pciDev, 1, master_dev, &dev)))
-//                        goto fail;
+                    if ((result = create_one_pci_device (pciDev, 1, card, &dev)))
+                        goto fail;
 
                   fail:
                     if (result)
@@ -441,7 +455,7 @@ pcan_search_and_create_pci_devices (void)
         if (!result && master_dev)      /* register only if at least one channel was found */
         {
             pcan_pci_register_driver (&pcan_drv.pci_drv);
-            dev->drvRegistered[0] = 1;
+            _pci_drv_registered = 1;
         }
     }
 
@@ -17,6 +17,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <adlink_main.h>
+#include <linux/mutex.h>
 
 #ifdef PCIEC_SUPPORT
 int pcan_pci_init (void);
@@ -25,7 +26,21 @@ void pcan_pci_deinit (void);
 int pcan_search_and_create_pci_devices (void);
 #endif
 
-void pcan_pci_clear_stored_interrupt (struct pcandev *dev);
+#define PCAN_PCI_CHANNELS 2    /* CAN channels on a PCI-7841 */
+
+/* resources shared by all channels of one card */
+struct pcan_pci_card
+{
+    struct pcandev *dev[PCAN_PCI_CHANNELS];     /* the channels, NULL if not created */
+    void *pvVirtConfigPort;     /* virtual address of the PITA registers */
+    u16 wIrq;                   /* the interrupt line of the card */
+    int nIrqUsers;              /* count of channels with enabled interrupt */
+    u16 wPitaMask;              /* PITA_ICR bits of the channels with enabled interrupt */
+    rtdm_irq_t irq_handle;      /* one interrupt handler serves all channels */
+    struct mutex irq_mutex;     /* guards nIrqUsers with the request and the release of irq_handle */
+    rtdm_lock_t lock;           /* guards wPitaMask and the interrupt enable bits of PITA_ICR */
+};
+
 void pcan_pci_enable_interrupt (struct pcandev *dev);
 
 #endif /* __ADLINK_PCI_H__ */
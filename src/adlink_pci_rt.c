@@ -15,48 +15,112 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#define PCI_FREE_IRQ()
-
-/* a special frame around the default irq handler */
+/* the card wide irq handler, services every channel which asserted its interrupt */
 static int
 pcan_pci_irqhandler_rt (rtdm_irq_t * irq_context)
 {
-    struct pcanctx_rt *ctx;
+    struct pcan_pci_card *card;
     struct pcandev *dev;
-    int ret;
+    u16 PitaICRLow;
+    u16 wEnabled;
+    u16 wAck = 0;
+    int i;
+
+    card = rtdm_irq_get_arg (irq_context, struct pcan_pci_card);
+    wEnabled = card->wPitaMask;
+
+    /* one read tells which channels are pending */
+    PitaICRLow = readw (card->pvVirtConfigPort + PITA_ICR);
+
+    /* another device on the shared line, reject without lock or chip access */
+    if (!(PitaICRLow & wEnabled))
+    {
+        for (i = 0; i < PCAN_PCI_CHANNELS; i++)
+            if ((dev = card->dev[i]) && (wEnabled & dev->port.pci.wPitaMask))
+                dev->dwIrqForeign++;
+        return RTDM_IRQ_NONE;
+    }
 
-    ctx = rtdm_irq_get_arg (irq_context, struct pcanctx_rt);
-    dev = ctx->dev;
+    /* each channel is serviced under its own chip_lock only */
+    for (i = 0; i < PCAN_PCI_CHANNELS; i++)
+    {
+        dev = card->dev[i];
+        if (!dev || !(wEnabled & dev->port.pci.wPitaMask))
+            continue;
+
+        if (!(PitaICRLow & dev->port.pci.wPitaMask))
+        {
+            dev->dwIrqForeign++;
+            continue;
+        }
 
-    ret = sja1000_irqhandler_rt (irq_context);
+        dev->dwIrqHandled++;
+        sja1000_irqhandler_common (dev);
+        wAck |= dev->port.pci.wPitaMask;
+    }
 
-    pcan_pci_clear_stored_interrupt (dev);
+    /* clear the stored interrupts of all serviced channels at once */
+    writew (wAck, card->pvVirtConfigPort + PITA_ICR);
 
-    return PCAN_IRQ_RETVAL (ret);
+    return RTDM_IRQ_HANDLED;
 }
 
 /* all about interrupt handling */
 static int
-pcan_pci_req_irq (struct rtdm_dev_context *context)
+pcan_pci_req_irq (struct pcandev *dev)
 {
-    struct pcanctx_rt *ctx;
-    struct pcandev *dev = (struct pcandev *) NULL;
+    struct pcan_pci_card *card = dev->port.pci.card;
+    rtdm_lockctx_t lockctx;
     int err;
 
-    ctx = (struct pcanctx_rt *) context->dev_private;
-    dev = ctx->dev;
-
     if (dev->wInitStep == 5)
     {
-        if ((err =
-             rtdm_irq_request (&ctx->irq_handle, ctx->irq, pcan_pci_irqhandler_rt,
-                               RTDM_IRQTYPE_SHARED | RTDM_IRQTYPE_EDGE, context->device->proc_name,
-                               ctx)))
-        {
+        /* the service task must run before the first interrupt is staged */
+        if ((err = sja1000_start_irq_task (dev)))
             return err;
+
+        /* the first channel opened on a card installs the handler for both,
+         * both channels may be opened at the same time */
+        mutex_lock (&card->irq_mutex);
+        if (!card->nIrqUsers)
+        {
+            if ((err =
+                 rtdm_irq_request (&card->irq_handle, card->wIrq, pcan_pci_irqhandler_rt,
+                                   RTDM_IRQTYPE_SHARED | RTDM_IRQTYPE_EDGE, DEVICE_NAME, card)))
+            {
+                mutex_unlock (&card->irq_mutex);
+                sja1000_stop_irq_task (dev);
+                return err;
+            }
         }
+        card->nIrqUsers++;
+        mutex_unlock (&card->irq_mutex);
+
+        rtdm_lock_get_irqsave (&card->lock, lockctx);
+        card->wPitaMask |= dev->port.pci.wPitaMask;
+        rtdm_lock_put_irqrestore (&card->lock, lockctx);
+
         pcan_pci_enable_interrupt (dev);
     }
 
     return 0;
 }
+
+/* detach the channel from the card handler, the last channel removes it */
+static void
+pcan_pci_release_card_irq (struct pcandev *dev)
+{
+    struct pcan_pci_card *card = dev->port.pci.card;
+    rtdm_lockctx_t lockctx;
+
+    rtdm_lock_get_irqsave (&card->lock, lockctx);
+    card->wPitaMask &= ~dev->port.pci.wPitaMask;
+    rtdm_lock_put_irqrestore (&card->lock, lockctx);
+
+    mutex_lock (&card->irq_mutex);
+    if (!--card->nIrqUsers)
+        rtdm_irq_free (&card->irq_handle);
+    mutex_unlock (&card->irq_mutex);
+
+    sja1000_stop_irq_task (dev);
+}
@@ -20,7 +20,6 @@
  */
 
 //#define PCAN_SJA1000_STATS
-#define PCAN_SJA1000_USES_ISR_LOCK
 #define PCAN_SJA1000_DONT_LOOP_ON_ISR
 //#define PCAN_SJA1000_DISABLE_IRQ
 
@@ -31,8 +30,13 @@
 #include <asm/errno.h>
 #include <asm/byteorder.h>      // because of little / big endian
 #include <linux/delay.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <nucleus/pod.h>        /* xnpod_migrate_thread() */
 #include <adlink_main.h>
 #include <adlink_fifo.h>
+#include <adlink_txq.h>
+#include <adlink_cyclic.h>
 #include <adlink_sja1000.h>
 #include <adlink_sja1000_rt.c>
 
@@ -49,6 +53,7 @@
 
 #define ARBIT_LOST_CAPTURE    11        /* transmit buffer: Identifier */
 #define ERROR_CODE_CAPTURE    12        /* RTR bit und data length code */
+#define ARBIT_LOST_BIT_MASK   0x1f      /* bit position in ARBIT_LOST_CAPTURE */
 #define ERROR_WARNING_LIMIT   13        /* start byte of data field */
 #define RX_ERROR_COUNTER      14
 #define TX_ERROR_COUNTER      15
@@ -86,6 +91,7 @@
 #define RELEASE_RECEIVE_BUFFER 0x04
 #define ABORT_TRANSMISSION     0x02
 #define TRANSMISSION_REQUEST   0x01
+#define SELF_RECEPTION_REQUEST 0x10
 
 /* CHIPSTATUS register */
 #define BUS_STATUS             0x80
@@ -127,6 +133,15 @@
 #define OUTPUT_CONTROL_MODE_1         0x02
 #define OUTPUT_CONTROL_MODE_0         0x01
 
+/* ERROR_CODE_CAPTURE register */
+#define ERROR_CODE_MASK               0xc0
+#define ERROR_CODE_BIT                0x00
+#define ERROR_CODE_FORM               0x40
+#define ERROR_CODE_STUFF              0x80
+#define ERROR_CODE_OTHER              0xc0
+#define ERROR_DIRECTION_RX            0x20      /* else the error occurred while transmitting */
+#define ERROR_SEGMENT_MASK            0x1f      /* same codes as CAN_ERR_PROT_LOC_... */
+
 /* TRANSMIT or RECEIVE BUFFER */
 #define BUFFER_EFF                    0x80      /* set for 29 bit identifier */
 #define BUFFER_RTR                    0x40      /* set for RTR request */
@@ -142,8 +157,11 @@
 /* additional informations */
 #define CLOCK_HZ                  16000000      /* crystal frequency */
 
-//*time for mode register to change mode */
-#define MODE_REGISTER_SWITCH_TIME 100   // msec
+/* time for mode register to change mode */
+#define MODE_REGISTER_SWITCH_TIMEOUT 100000     /* nsec */
+
+/* longest wait for a frame on the way before reset mode cuts it off */
+#define TRANSMISSION_DRAIN_TIMEOUT  1000000     /* nsec */
 
 /* some CLKDIVIDER register contents, hardware architecture dependend */
 #define PELICAN_SINGLE  (CAN_MODE | CAN_BYPASS | 0x07 | CLOCK_OFF)
@@ -154,11 +172,37 @@
 /* hardware depended setup for OUTPUT_CONTROL register */
 #define OUTPUT_CONTROL_SETUP (OUTPUT_CONTROL_TRANSISTOR_P0 | OUTPUT_CONTROL_TRANSISTOR_N0 | OUTPUT_CONTROL_MODE_1)
 
-/* the interrupt enables */
+/* the interrupt enables, ARBIT_LOST_INTERRUPT_ENABLE is added with PCAN_INIT_ERROR_REPORTS */
 #define INTERRUPT_ENABLE_SETUP (RECEIVE_INTERRUPT_ENABLE | TRANSMIT_INTERRUPT_ENABLE | DATA_OVERRUN_INTERRUPT_ENABLE | BUS_ERROR_INTERRUPT_ENABLE | ERROR_PASSIV_INTERRUPT_ENABLE | ERROR_WARN_INTERRUPT_ENABLE)
 
+/* frame length in bits, SOF up to the CRC sequence without stuff bits */
+#define FRAME_BITS_STUFFED_SFF    34
+#define FRAME_BITS_STUFFED_EFF    54
+
+/* CRC delimiter, ACK slot and delimiter and EOF - never stuffed */
+#define FRAME_BITS_TRAILER        10
+
+/* bus idle bits separating two frames */
+#define FRAME_BITS_INTERMISSION   3
+
 /* the maximum number of handled messages in one interrupt */
 #define MAX_MESSAGES_PER_INTERRUPT 8
+#if MAX_MESSAGES_PER_INTERRUPT >= IRQ_STAGE_FRAMES
+#error "IRQ_STAGE_FRAMES too small for MAX_MESSAGES_PER_INTERRUPT"
+#endif
+
+/* threaded interrupt handling: the top half only stages the chip's state */
+static int irq_thread = 0;
+static int irq_thread_cpu = -1;
+static int irq_thread_prio = RTDM_TASK_HIGHEST_PRIORITY;
+
+module_param (irq_thread, int, 0444);
+module_param (irq_thread_cpu, int, 0444);
+module_param (irq_thread_prio, int, 0444);
+
+MODULE_PARM_DESC (irq_thread, "Defer interrupt work to a RT service task per channel (0 = off)");
+MODULE_PARM_DESC (irq_thread_cpu, "CPU the service tasks are pinned to (-1 = any)");
+MODULE_PARM_DESC (irq_thread_prio, "RTDM priority of the service tasks");
 
 #ifndef PCAN_SJA1000_DONT_LOOP_ON_ISR
 /* the maximum number of handled sja1000 interrupts in 1 handler entry */
@@ -203,43 +247,55 @@ sja1000_print_stats (struct pcandev_stats *s)
 #endif
 
 /**
- * guards writing sja1000's command register in multicore environments
+ * writes sja1000's command register, callers running concurrently to the irq handler hold chip_lock
  */
 static inline void
 guarded_write_command (struct pcandev *dev, u8 data)
 {
-    DECLARE_SPIN_LOCK_IRQSAVE_FLAGS;
-
-    SPIN_LOCK_IRQSAVE (&dev->wlock);
     dev->writereg (dev, COMMAND, data);
     dev->readreg (dev, CHIPSTATUS);     /* draw a breath after writing the command register */
-    SPIN_UNLOCK_IRQRESTORE (&dev->wlock);
     /* wmb(); */
 }
 
+/**
+ * account the duration of a mode switch started at qwStart
+ */
+static inline int
+account_mode_switch (struct pcandev *dev, nanosecs_abs_t qwStart, u32 * pdwLast, u32 * pdwMax,
+                     int done)
+{
+    *pdwLast = (u32) (rtdm_clock_read () - qwStart);
+    if (*pdwLast > *pdwMax)
+        *pdwMax = *pdwLast;
+
+    if (done)
+        return 0;
+
+    dev->dwSwitchTimeouts++;
+    return -EIO;
+}
+
 /**
  * switches the chip into reset mode
  */
 static int
 set_reset_mode (struct pcandev *dev)
 {
-    u32 dwStart = get_mtime ();
+    nanosecs_abs_t qwStart = rtdm_clock_read ();
+    nanosecs_abs_t qwDeadline = qwStart + MODE_REGISTER_SWITCH_TIMEOUT;
     u8 tmp;
 
     tmp = dev->readreg (dev, MODE);
-    while (!(tmp & RESET_MODE) && ((get_mtime () - dwStart) < MODE_REGISTER_SWITCH_TIME))
+    while (!(tmp & RESET_MODE) && (rtdm_clock_read () < qwDeadline))
     {
         dev->writereg (dev, MODE, RESET_MODE);  /* force into reset mode */
         wmb ();
         udelay (1);
-        /* schedule(); */
         tmp = dev->readreg (dev, MODE);
     }
 
-    if (!(tmp & RESET_MODE))
-        return -EIO;
-    else
-        return 0;
+    return account_mode_switch (dev, qwStart, &dev->dwResetSwitchNs, &dev->dwResetSwitchMaxNs,
+                                tmp & RESET_MODE);
 }
 
 /**
@@ -248,23 +304,21 @@ set_reset_mode (struct pcandev *dev)
 static int
 set_normal_mode (struct pcandev *dev, u8 ucModifier)
 {
-    u32 dwStart = get_mtime ();
+    nanosecs_abs_t qwStart = rtdm_clock_read ();
+    nanosecs_abs_t qwDeadline = qwStart + MODE_REGISTER_SWITCH_TIMEOUT;
     u8 tmp;
 
     tmp = dev->readreg (dev, MODE);
-    while ((tmp != ucModifier) && ((get_mtime () - dwStart) < MODE_REGISTER_SWITCH_TIME))
+    while ((tmp != ucModifier) && (rtdm_clock_read () < qwDeadline))
     {
         dev->writereg (dev, MODE, ucModifier);  /* force into normal mode */
         wmb ();
         udelay (1);
-        // schedule();
         tmp = dev->readreg (dev, MODE);
     }
 
-    if (tmp != ucModifier)
-        return -EIO;
-    else
-        return 0;
+    return account_mode_switch (dev, qwStart, &dev->dwNormalSwitchNs, &dev->dwNormalSwitchMaxNs,
+                                tmp == ucModifier);
 }
 
 /**
@@ -286,7 +340,7 @@ static inline void
 sja1000_irq_enable (struct pcandev *dev)
 {
     /* dev->writereg(dev, INTERRUPT_ENABLE, INTERRUPT_ENABLE_SETUP); */
-    sja1000_irq_enable_mask (dev, INTERRUPT_ENABLE_SETUP);
+    sja1000_irq_enable_mask (dev, dev->ucIrqEnable);
 }
 
 static inline void
@@ -318,14 +372,62 @@ clkdivider (struct pcandev *dev)
 }
 
 /**
- * init CAN-chip
+ * nominal bit time in nsec of a BTR0BTR1 setting
  */
-int
-sja1000_open (struct pcandev *dev, u16 btr0btr1, u8 bExtended, u8 bListenOnly)
+static u32
+sja1000_bit_time_ns (u16 btr0btr1)
+{
+    u32 brp = ((btr0btr1 >> 8) & 0x3f) + 1;
+    u32 tseg1 = (btr0btr1 & 0x0f) + 1;
+    u32 tseg2 = ((btr0btr1 >> 4) & 0x07) + 1;
+
+    /* a time quantum lasts 2 * (BRP + 1) clock periods, a bit 1 + TSEG1 + TSEG2 quanta */
+    return (2 * brp * (1 + tseg1 + tseg2) * 1000) / (CLOCK_HZ / 1000000);
+}
+
+/**
+ * the mode register bits and the transmission command of a mode of operation
+ */
+static u8
+sja1000_mode_modifier (struct pcandev *dev, u8 ucFlags)
+{
+    u8 ucModifier = NORMAL_MODE;
+
+    if (ucFlags & PCAN_INIT_LISTEN_ONLY)
+        ucModifier |= LISTEN_ONLY_MODE;
+    if (ucFlags & PCAN_INIT_SELF_TEST)
+        ucModifier |= SELF_TEST_MODE;
+
+    dev->ucTxRequest = (ucFlags & PCAN_INIT_SELF_RECEPTION) ? SELF_RECEPTION_REQUEST : TRANSMISSION_REQUEST;
+    dev->ucIrqEnable = INTERRUPT_ENABLE_SETUP;
+    if (ucFlags & PCAN_INIT_ERROR_REPORTS)
+        dev->ucIrqEnable |= ARBIT_LOST_INTERRUPT_ENABLE;
+
+    return ucModifier;
+}
+
+/**
+ * take over the settings of a PCAN_INIT, the caller holds chip_lock while the chip mode changes,
+ * so the interrupt handler sees them together with the mode they belong to
+ */
+static void
+sja1000_commit_settings (struct pcandev *dev, u16 btr0btr1, u8 bExtended, u8 bListenOnly)
+{
+    dev->wBTR0BTR1 = btr0btr1;
+    dev->ucCANMsgType = bExtended;
+    dev->bExtended = bExtended;
+    dev->ucListenOnly = bListenOnly;
+}
+
+/**
+ * init CAN-chip, the caller holds chip_lock
+ */
+static int
+__sja1000_open (struct pcandev *dev, u16 btr0btr1, u8 bExtended, u8 bListenOnly)
 {
     int result = 0;
     u8 _clkdivider = clkdivider (dev);
-    u8 ucModifier = (bListenOnly) ? LISTEN_ONLY_MODE : NORMAL_MODE;
+    u8 ucModifier = sja1000_mode_modifier (dev, bListenOnly);
 
     DPRINTK ("%s(), minor = %d.\n", __FUNCTION__, dev->nMinor);
 
@@ -337,8 +439,8 @@ sja1000_open (struct pcandev *dev, u16 btr0btr1, u8 bExtended, u8 bListenOnly)
     /* take a fresh status */
     dev->wCANStatus = 0;
 
-    /* store extended mode (standard still accepted) */
-    dev->bExtended = bExtended;
+    /* store extended mode (standard still accepted) and the rest */
+    sja1000_commit_settings (dev, btr0btr1, bExtended, bListenOnly);
 
     /* configure clock divider register, switch into pelican mode, depended of of type */
     dev->writereg (dev, CLKDIVIDER, _clkdivider);
@@ -358,6 +460,7 @@ sja1000_open (struct pcandev *dev, u16 btr0btr1, u8 bExtended, u8 bListenOnly)
     /* configure bus timing registers */
     dev->writereg (dev, TIMING0, (u8) ((btr0btr1 >> 8) & 0xff));
     dev->writereg (dev, TIMING1, (u8) ((btr0btr1) & 0xff));
+    dev->dwBitTimeNs = sja1000_bit_time_ns (btr0btr1);
 
     /* configure output control registers */
     dev->writereg (dev, OUTPUT_CONTROL, OUTPUT_CONTROL_SETUP);
@@ -382,126 +485,201 @@ sja1000_open (struct pcandev *dev, u16 btr0btr1, u8 bExtended, u8 bListenOnly)
 }
 
 /**
- * release CAN-chip
+ * init CAN-chip, the interrupt handler may already run on the shared line
  */
-void
-sja1000_release (struct pcandev *dev)
+int
+sja1000_open (struct pcandev *dev, u16 btr0btr1, u8 bExtended, u8 bListenOnly)
 {
-    DPRINTK ("%s()\n", __FUNCTION__);
-
-    /* abort pending transmissions */
-    guarded_write_command (dev, ABORT_TRANSMISSION);
+    int result;
 
-    /* disable CAN interrupts and set chip in reset mode */
-    sja1000_irq_disable (dev);
-    set_reset_mode (dev);
+    SJA1000_LOCK_IRQSAVE (chip_lock);
+    result = __sja1000_open (dev, btr0btr1, bExtended, bListenOnly);
+    SJA1000_UNLOCK_IRQRESTORE (chip_lock);
 
-#ifdef PCAN_SJA1000_STATS
-    sja1000_print_stats (&dev_stats);
-#endif
+    return result;
 }
 
 /**
- * read CAN-data from chip, supposed a message is available
+ * wait a little for a frame on the way to leave before reset mode cuts it off
  */
-static int
-sja1000_read_frames (SJA1000_METHOD_ARGS)
+static void
+sja1000_drain (struct pcandev *dev)
 {
-    int msgs = MAX_MESSAGES_PER_INTERRUPT;
-    u8 fi;
-    u8 dreg;
-    u8 dlc;
-    ULCONV localID;
-    struct can_frame frame;
-    struct timeval tv;
+    nanosecs_abs_t qwDeadline;
+    u8 status;
 
-    int i;
+    qwDeadline = rtdm_clock_read () + min_t (u64, (u64) FRAME_BITS_MAX * dev->dwBitTimeNs,
+                                             TRANSMISSION_DRAIN_TIMEOUT);
+    do
+    {
+        /* the interrupt handler may run in between */
+        SJA1000_LOCK_IRQSAVE (chip_lock);
+        status = dev->readreg (dev, CHIPSTATUS);
+        SJA1000_UNLOCK_IRQRESTORE (chip_lock);
+
+        if (status & TRANS_BUFFER_STATUS)
+            break;
+
+        udelay (1);
+    }
+    while (rtdm_clock_read () < qwDeadline);
+}
+
+/**
+ * change bitrate and mode of an opened CAN-chip, only registers which differ are written
+ */
+int
+sja1000_reconfigure (struct pcandev *dev, u16 btr0btr1, u8 bExtended, u8 bListenOnly)
+{
     int result = 0;
+    u8 ucOldIrqEnable;
+    u8 ucOldModifier;
+    u8 ucModifier;
+    int cut;
+    int inplace = 0;
+    nanosecs_abs_t qwStart;
+    rtdm_lockctx_t rxlockctx;
 
-    /* DPRINTK("sja1000_read_frames()\n"); */
+    DPRINTK ("%s(), minor = %d.\n", __FUNCTION__, dev->nMinor);
 
-    do
-    {
-        DO_GETTIMEOFDAY (tv);   /* create timestamp */
+    SJA1000_LOCK_IRQSAVE (chip_lock);
+    ucOldIrqEnable = dev->ucIrqEnable;
+    ucOldModifier = sja1000_mode_modifier (dev, dev->ucListenOnly);
+    ucModifier = sja1000_mode_modifier (dev, bListenOnly);
 
-        fi = dev->readreg (dev, RECEIVE_FRAME_BASE);
-        dlc = fi & BUFFER_DLC_MASK;
+    /* nothing to do in reset mode, a frame on the way is left alone; the interrupt enables
+     * are writeable in operating mode too */
+    if ((btr0btr1 == dev->wBTR0BTR1) && (ucModifier == ucOldModifier))
+    {
+        if (dev->ucIrqEnable != ucOldIrqEnable)
+            sja1000_irq_enable (dev);
+        sja1000_commit_settings (dev, btr0btr1, bExtended, bListenOnly);
+        inplace = 1;
+    }
+    else                        /* the old settings stay with the old mode until reset mode */
+        sja1000_mode_modifier (dev, dev->ucListenOnly);
+    SJA1000_UNLOCK_IRQRESTORE (chip_lock);
 
-        if (dlc > 8)
-            dlc = 8;
+    if (inplace)
+        return 0;
 
-        if (fi & BUFFER_EFF)
-        {
-            /* extended frame format (EFF) */
-            dreg = RECEIVE_FRAME_BASE + 5;
+    sja1000_drain (dev);
 
-#if defined(__LITTLE_ENDIAN)
-            localID.uc[3] = dev->readreg (dev, RECEIVE_FRAME_BASE + 1);
-            localID.uc[2] = dev->readreg (dev, RECEIVE_FRAME_BASE + 2);
-            localID.uc[1] = dev->readreg (dev, RECEIVE_FRAME_BASE + 3);
-            localID.uc[0] = dev->readreg (dev, RECEIVE_FRAME_BASE + 4);
-#elif defined(__BIG_ENDIAN)
-            localID.uc[0] = dev->readreg (dev, RECEIVE_FRAME_BASE + 1);
-            localID.uc[1] = dev->readreg (dev, RECEIVE_FRAME_BASE + 2);
-            localID.uc[2] = dev->readreg (dev, RECEIVE_FRAME_BASE + 3);
-            localID.uc[3] = dev->readreg (dev, RECEIVE_FRAME_BASE + 4);
-#else
-#error  "Please fix the endianness defines in <asm/byteorder.h>"
-#endif
+    /* the bus timing and the listen only flag are only writeable in reset mode */
+    SJA1000_LOCK_IRQSAVE (chip_lock);
+    qwStart = rtdm_clock_read ();
 
-            /*                      frame.can_id = (dev->readreg(dev, RECEIVE_FRAME_BASE + 1) << (5+16))
-             *                                   | (dev->readreg(dev, RECEIVE_FRAME_BASE + 2) << (5+8))
-             *                                   | (dev->readreg(dev, RECEIVE_FRAME_BASE + 3) << 5)
-             *                                   | (dev->readreg(dev, RECEIVE_FRAME_BASE + 4) >> 3);
-             */
+    cut = (dev->ucTxState == TX_BUSY || dev->ucTxState == TX_ABORTING)
+        && !(dev->readreg (dev, CHIPSTATUS) & TRANS_BUFFER_STATUS);
 
-            frame.can_id = (localID.ul >> 3) | CAN_EFF_FLAG;
+    result = set_reset_mode (dev);
+    if (!result)
+    {
+        /* a frame cut off never raises its transmit interrupt, it is sent again ahead of its class */
+        if (cut)
+        {
+            dev->ucTxState = TX_REQUEUED;
+            atomic_set (&dev->DataSendReady, 1);
         }
-        else
+
+        if (btr0btr1 != dev->wBTR0BTR1)
         {
-            /* standard frame format (EFF) */
-            dreg = RECEIVE_FRAME_BASE + 3;
+            if ((btr0btr1 >> 8) != (dev->wBTR0BTR1 >> 8))
+                dev->writereg (dev, TIMING0, (u8) ((btr0btr1 >> 8) & 0xff));
+            if ((btr0btr1 & 0xff) != (dev->wBTR0BTR1 & 0xff))
+                dev->writereg (dev, TIMING1, (u8) ((btr0btr1) & 0xff));
+            dev->dwBitTimeNs = sja1000_bit_time_ns (btr0btr1);
+
+            /* nothing received or queued at the old bitrate survives, nothing at the new one is lost */
+            pcan_tx_flush (dev);
+            pcan_lock_get_irqsave (&dev->rx_lock, &rxlockctx);
+            pcan_fifo_flush (&dev->readFifo);
+            pcan_lock_put_irqrestore (&dev->rx_lock, &rxlockctx);
+        }
 
-            localID.ul = 0;
-#if defined(__LITTLE_ENDIAN)
-            localID.uc[3] = dev->readreg (dev, RECEIVE_FRAME_BASE + 1);
-            localID.uc[2] = dev->readreg (dev, RECEIVE_FRAME_BASE + 2);
-#elif defined(__BIG_ENDIAN)
-            localID.uc[0] = dev->readreg (dev, RECEIVE_FRAME_BASE + 1);
-            localID.uc[1] = dev->readreg (dev, RECEIVE_FRAME_BASE + 2);
-#else
-#error  "Please fix the endianness defines in <asm/byteorder.h>"
-#endif
+        sja1000_mode_modifier (dev, bListenOnly);
+        result = set_normal_mode (dev, ucModifier);
+        if (dev->ucIrqEnable != ucOldIrqEnable)
+            sja1000_irq_enable (dev);
+        sja1000_commit_settings (dev, btr0btr1, bExtended, bListenOnly);
 
-            frame.can_id = (localID.ul >> 21);
+        dev->dwReconfigResetNs = (u32) (rtdm_clock_read () - qwStart);
+        if (dev->dwReconfigResetNs > dev->dwReconfigResetMaxNs)
+            dev->dwReconfigResetMaxNs = dev->dwReconfigResetNs;
+    }
+    SJA1000_UNLOCK_IRQRESTORE (chip_lock);
 
-            /*                      frame.can_id = (dev->readreg(dev, RECEIVE_FRAME_BASE + 1) << 3)
-             *                                   | (dev->readreg(dev, RECEIVE_FRAME_BASE + 2) >> 5);
-             */
-        }
+    return result;
+}
+
+/**
+ * release CAN-chip
+ */
+void
+sja1000_release (struct pcandev *dev)
+{
+    DPRINTK ("%s()\n", __FUNCTION__);
+
+    SJA1000_LOCK_IRQSAVE (chip_lock);
+
+    /* abort pending transmissions */
+    guarded_write_command (dev, ABORT_TRANSMISSION);
+
+    /* disable CAN interrupts and set chip in reset mode */
+    sja1000_irq_disable (dev);
+    set_reset_mode (dev);
+
+    /* reset mode ends any transmission, no transmit interrupt hands the transmitter back */
+    dev->ucTxState = TX_IDLE;
+    atomic_set (&dev->DataSendReady, 1);
+
+    SJA1000_UNLOCK_IRQRESTORE (chip_lock);
+
+#ifdef PCAN_SJA1000_STATS
+    sja1000_print_stats (&dev_stats);
+#endif
+}
+
+/**
+ * length of a frame on the bus in bits from SOF to the end of EOF,
+ * the count of stuff bits is estimated as half of the worst case
+ */
+static inline u32
+sja1000_frame_bits (u8 fi)
+{
+    u32 bits = (fi & BUFFER_RTR) ? 0 : (min (fi & BUFFER_DLC_MASK, 8) << 3);
 
-        if (fi & BUFFER_RTR)
-            frame.can_id |= CAN_RTR_FLAG;
+    /* SOF up to the CRC sequence is subject to bit stuffing */
+    bits += (fi & BUFFER_EFF) ? FRAME_BITS_STUFFED_EFF : FRAME_BITS_STUFFED_SFF;
 
-        *(__u64 *) & frame.data[0] = (__u64) 0; /* clear aligned data section */
+    return bits + ((bits - 1) >> 3) + FRAME_BITS_TRAILER;
+}
 
-        for (i = 0; i < dlc; i++)
-            frame.data[i] = dev->readreg (dev, dreg++);
+/**
+ * copy all frames out of the receive buffer as raw images, supposed a message is available
+ */
+static int
+sja1000_read_images (struct pcandev *dev, IRQ_IMAGE * img)
+{
+    int msgs = MAX_MESSAGES_PER_INTERRUPT;
+    u8 *image;
+    u8 len;
+    int i;
 
-        frame.can_dlc = dlc;
+    /* DPRINTK("sja1000_read_images()\n"); */
 
-        SJA1000_LOCK_IRQSAVE (in_lock);
+    img->ucFrames = 0;
 
-        if ((i = pcan_chardev_rx (dev, &frame, &tv)))   /* put into specific data sink */
-            result = i;         /* save the last result */
+    do
+    {
+        image = img->ucImage[img->ucFrames++];
 
-        SJA1000_UNLOCK_IRQRESTORE (in_lock);
+        /* frame info, identifier and data, nothing beyond the data length code */
+        image[0] = dev->readreg (dev, RECEIVE_FRAME_BASE);
+        len = ((image[0] & BUFFER_EFF) ? 5 : 3) + min (image[0] & BUFFER_DLC_MASK, 8);
 
-        /*              Any error processing on result =! 0 here?
-         *              Indeed we have to read from the controller as long as we receive data to
-         *              unblock the controller. If we have problems to fill the CAN frames into
-         *              the receive queues, this cannot be handled inside the interrupt.
-         */
+        for (i = 1; i < len; i++)
+            image[i] = dev->readreg (dev, RECEIVE_FRAME_BASE + i);
 
         /* release the receive buffer */
         guarded_write_command (dev, RELEASE_RECEIVE_BUFFER);
@@ -512,397 +690,834 @@ sja1000_read_frames (SJA1000_METHOD_ARGS)
     }
     while (dev->readreg (dev, CHIPSTATUS) & RECEIVE_BUFFER_STATUS && (msgs--));
 
-    return result;
+    return img->ucFrames;
 }
 
-
 /**
- * write CAN-data to chip,
+ * make a can_frame out of a receive buffer image, called by the reader of the read fifo
  */
-static int
-__sja1000_write_frame (struct pcandev *dev, struct can_frame *cf)
+void
+sja1000_decode_image (u8 * image, struct can_frame *frame)
 {
-    u8 fi;
-    u8 dlc;
-    canid_t id;
+    u8 fi = image[0];
+    u8 dlc = fi & BUFFER_DLC_MASK;
+    u8 *data;
     ULCONV localID;
-    u8 dreg;
-    int i;
-
-    fi = dlc = cf->can_dlc;
-    id = localID.ul = cf->can_id;
-
-#ifdef PCAN_SJA1000_STATS
-    dev_stats.write_frm_count++;
-#endif
 
-    if (id & CAN_RTR_FLAG)
-        fi |= BUFFER_RTR;
+    if (dlc > 8)
+        dlc = 8;
 
-    if (id & CAN_EFF_FLAG)
+    if (fi & BUFFER_EFF)
     {
-        dreg = TRANSMIT_FRAME_BASE + 5;
-        fi |= BUFFER_EFF;
-
-        localID.ul <<= 3;
-
-        dev->writereg (dev, TRANSMIT_FRAME_BASE, fi);
+        /* extended frame format (EFF) */
+        data = &image[5];
 
 #if defined(__LITTLE_ENDIAN)
-        dev->writereg (dev, TRANSMIT_FRAME_BASE + 1, localID.uc[3]);
-        dev->writereg (dev, TRANSMIT_FRAME_BASE + 2, localID.uc[2]);
-        dev->writereg (dev, TRANSMIT_FRAME_BASE + 3, localID.uc[1]);
-        dev->writereg (dev, TRANSMIT_FRAME_BASE + 4, localID.uc[0]);
+        localID.uc[3] = image[1];
+        localID.uc[2] = image[2];
+        localID.uc[1] = image[3];
+        localID.uc[0] = image[4];
 #elif defined(__BIG_ENDIAN)
-        dev->writereg (dev, TRANSMIT_FRAME_BASE + 1, localID.uc[0]);
-        dev->writereg (dev, TRANSMIT_FRAME_BASE + 2, localID.uc[1]);
-        dev->writereg (dev, TRANSMIT_FRAME_BASE + 3, localID.uc[2]);
-        dev->writereg (dev, TRANSMIT_FRAME_BASE + 4, localID.uc[3]);
+        localID.uc[0] = image[1];
+        localID.uc[1] = image[2];
+        localID.uc[2] = image[3];
+        localID.uc[3] = image[4];
 #else
 #error  "Please fix the endianness defines in <asm/byteorder.h>"
 #endif
+
+        frame->can_id = (localID.ul >> 3) | CAN_EFF_FLAG;
     }
     else
     {
-        dreg = TRANSMIT_FRAME_BASE + 3;
-
-        localID.ul <<= 21;
-
-        dev->writereg (dev, TRANSMIT_FRAME_BASE, fi);
+        /* standard frame format (EFF) */
+        data = &image[3];
 
+        localID.ul = 0;
 #if defined(__LITTLE_ENDIAN)
-        dev->writereg (dev, TRANSMIT_FRAME_BASE + 1, localID.uc[3]);
-        dev->writereg (dev, TRANSMIT_FRAME_BASE + 2, localID.uc[2]);
+        localID.uc[3] = image[1];
+        localID.uc[2] = image[2];
 #elif defined(__BIG_ENDIAN)
-        dev->writereg (dev, TRANSMIT_FRAME_BASE + 1, localID.uc[0]);
-        dev->writereg (dev, TRANSMIT_FRAME_BASE + 2, localID.uc[1]);
+        localID.uc[0] = image[1];
+        localID.uc[1] = image[2];
 #else
 #error  "Please fix the endianness defines in <asm/byteorder.h>"
 #endif
-    }
 
-    for (i = 0; i < dlc; i++)
-    {
-        dev->writereg (dev, dreg++, cf->data[i]);
+        frame->can_id = (localID.ul >> 21);
     }
 
-    /* request a transmission */
-    guarded_write_command (dev, TRANSMISSION_REQUEST);
+    if (fi & BUFFER_RTR)
+        frame->can_id |= CAN_RTR_FLAG;
 
-    return 0;
+    *(__u64 *) & frame->data[0] = (__u64) 0;    /* clear aligned data section */
+    memcpy (frame->data, data, dlc);
+
+    frame->can_dlc = dlc;
 }
 
 /**
- * Called by isr 
+ * compare the identifier of a received frame with the reference frame of the transmit matrix
  */
 static int
-__sja1000_write (SJA1000_METHOD_ARGS)
+__sja1000_is_reference (struct pcandev *dev, u8 * image)
+{
+    u8 *ref = dev->txRef.ucImage;
+
+    if ((image[0] ^ ref[0]) & BUFFER_EFF)
+        return 0;
+
+    /* the bits below the identifier hold the RTR flag or nothing */
+    if (image[0] & BUFFER_EFF)
+        return image[1] == ref[1] && image[2] == ref[2] && image[3] == ref[3] && !((image[4] ^ ref[4]) & 0xf8);
+
+    return image[1] == ref[1] && !((image[2] ^ ref[2]) & 0xe0);
+}
+
+static int
+sja1000_is_reference (struct pcandev *dev, u8 * image)
 {
+    rtdm_lockctx_t lockctx;
     int result;
-    TPCANMsg msg;
-    struct can_frame cf;
 
-#ifdef PCAN_SJA1000_STATS
-    dev_stats._write_count++;
-#endif
+    /* the reference is changed under cyclic_lock, a torn one must not be compared with */
+    rtdm_lock_get_irqsave (&dev->cyclic_lock, lockctx);
+    result = dev->ucRefActive && __sja1000_is_reference (dev, image);
+    rtdm_lock_put_irqrestore (&dev->cyclic_lock, lockctx);
 
-    /* DPRINTK("sja1000_write() %d\n", dev->writeFifo.nStored); */
+    return result;
+}
 
-    SJA1000_LOCK_IRQSAVE (out_lock);
+/**
+ * put the images read out by one interrupt into the read fifo, decoding is left to the reader
+ */
+static int
+sja1000_queue_frames (struct pcandev *dev, IRQ_IMAGE * img)
+{
+    nanosecs_abs_t qwSofTimestamp[IRQ_STAGE_FRAMES];
+    nanosecs_abs_t qwEof;
+    int count = img->ucFrames;
+    int i;
+    int result = 0;
 
-    /* get a fifo element and step forward */
-    result = pcan_fifo_get (&dev->writeFifo, &msg);
+    /* the newest frame has just completed when the interrupt was entered, the
+     * older ones are assumed to have been received back to back before it */
+    qwEof = img->qwTimestamp;
+    for (i = count - 1; i >= 0; i--)
+    {
+        qwSofTimestamp[i] = qwEof - (nanosecs_abs_t) sja1000_frame_bits (img->ucImage[i][0]) * dev->dwBitTimeNs;
+        qwEof = qwSofTimestamp[i] - FRAME_BITS_INTERMISSION * dev->dwBitTimeNs;
+    }
 
-    SJA1000_WAKEUP_EMPTY ();
+    /* there is only one producer of the read fifo at a time, no lock needed */
+    for (i = 0; i < count; i++)
+    {
+        int err;
 
-    SJA1000_UNLOCK_IRQRESTORE (out_lock);
+        /* filter out extended messages in non extended mode */
+        if (!dev->bExtended && (img->ucImage[i][0] & BUFFER_EFF))
+            continue;
 
-    if (result)
-        return result;
+        /* the transmit matrix is timed from the start of the reference frame */
+        if (dev->ucRefActive && sja1000_is_reference (dev, img->ucImage[i]))
+            if (pcan_matrix_trigger (dev, qwSofTimestamp[i]) > 0)
+                dev->ucTxKick = 1;
 
-    /* convert from old style FIFO message until FIFO supports new */
-    /* struct can_frame and error frames */
-    msg2frame (&cf, &msg);
+        if ((err = pcan_chardev_rx_image (dev, img->ucImage[i], img->qwTimestamp, qwSofTimestamp[i])))        /* put into specific data sink */
+            result = err;       /* save the last result */
+    }
 
-    __sja1000_write_frame (dev, &cf);
+    /*              Any error processing on result =! 0 here?
+     *              Indeed we have to read from the controller as long as we receive data to
+     *              unblock the controller. If we have problems to fill the CAN frames into
+     *              the receive queues, this cannot be handled inside the interrupt.
+     */
 
-    return 0;
+    return result;
 }
 
 
 /**
- * write CAN-data from FIFO to chip
+ * make the transmit buffer image of a frame, called when the frame is queued
  */
-int
-sja1000_write (SJA1000_METHOD_ARGS)
+void
+sja1000_marshal (struct can_frame *cf, TX_IMAGE * img)
 {
-    int err = 0;
-#ifdef PCAN_SJA1000_USES_ISR_LOCK
-    DECLARE_SPIN_LOCK_IRQSAVE_FLAGS;
-
-    SPIN_LOCK_IRQSAVE (&dev->isr_lock);
-#endif
-
-#ifdef PCAN_SJA1000_STATS
-    dev_stats.write_count++;
-#endif
+    u8 *image = img->ucImage;
+    u8 fi = cf->can_dlc & BUFFER_DLC_MASK;
+    u8 len = min (fi, (u8) 8);
+    canid_t id = cf->can_id;
 
-    /* DPRINTK("sja1000_write() %d\n", dev->writeFifo.nStored); */
+    img->dwId = id;
 
-    /* Check if Tx buffer is empty before writing on */
-    if (dev->readreg (dev, CHIPSTATUS) & TRANS_BUFFER_STATUS)
+    if (id & CAN_RTR_FLAG)
     {
-#ifdef NO_RT
-        err = __sja1000_write (dev);
-#else
-        err = __sja1000_write (dev, ctx);
-#endif
+        fi |= BUFFER_RTR;
+        len = 0;                /* a remote frame carries no data */
     }
 
-#ifdef PCAN_SJA1000_USES_ISR_LOCK
-    SPIN_UNLOCK_IRQRESTORE (&dev->isr_lock);
-#endif
+    if (id & CAN_EFF_FLAG)
+    {
+        /* the 29 identifier bits left aligned in 4 bytes, most significant first */
+        id = (id & CAN_EFF_MASK) << 3;
+        image[0] = fi | BUFFER_EFF;
+        image[1] = (u8) (id >> 24);
+        image[2] = (u8) (id >> 16);
+        image[3] = (u8) (id >> 8);
+        image[4] = (u8) id;
+        memcpy (&image[5], cf->data, len);
+        img->ucLen = len + 5;
+    }
+    else
+    {
+        /* the 11 identifier bits left aligned in 2 bytes */
+        id = (id & CAN_SFF_MASK) << 5;
+        image[0] = fi;
+        image[1] = (u8) (id >> 8);
+        image[2] = (u8) id;
+        memcpy (&image[3], cf->data, len);
+        img->ucLen = len + 3;
+    }
 
-    return err;
+    img->wBits = (u16) sja1000_frame_bits (image[0]);
 }
 
 /**
- * handle a interrupt request
+ * write a marshalled frame to the chip and request its transmission
  */
-int
-sja1000_irqhandler_common (SJA1000_METHOD_ARGS)
+static void
+__sja1000_write_image (struct pcandev *dev, TX_IMAGE * img)
 {
-    int ret = SJA1000_IRQ_NONE;
-    u8 irqstatus;
-    int err;
-    u16 rwakeup = 0;
-    u16 wwakeup = 0;
-#ifdef MAX_INTERRUPTS_PER_ENTRY
-    /* except the Rx flag, but this is processed by polling the Rx BUFFER */
-    /* STATUS reg bit */
-    int j = MAX_INTERRUPTS_PER_ENTRY;
-#endif
-#ifdef PCAN_SJA1000_USES_ISR_LOCK
-    DECLARE_SPIN_LOCK_IRQSAVE_FLAGS;
-#endif
-#ifdef PCAN_SJA1000_DISABLE_IRQ
-    int int_disabled = 0;
-#endif
-    struct can_frame ef;
-
-    memset (&ef, 0, sizeof (ef));
-
-    /* DPRINTK("sja1000_base_irqhandler|sja1000_irqhandler_rt()\n"); */
-
-#ifdef PCAN_SJA1000_USES_ISR_LOCK
-    SPIN_LOCK_IRQSAVE (&dev->isr_lock);
-#endif
+    u32 dwLatency;
+    int i;
 
 #ifdef PCAN_SJA1000_STATS
-    dev_stats.int_count++;
+    dev_stats.write_frm_count++;
 #endif
 
-    SJA1000_LOCK_IRQSAVE (sja_lock);
+    for (i = 0; i < img->ucLen; i++)
+        dev->writereg (dev, TRANSMIT_FRAME_BASE + i, img->ucImage[i]);
 
-#if defined(PCAN_SJA1000_DONT_LOOP_ON_ISR)
-    irqstatus = dev->readreg (dev, INTERRUPT_STATUS);
-    if (irqstatus)
+    if (img->ucFlags & PCAN_WR_SINGLE_SHOT)
+    {
+        /* reading the capture register arms it for this frame */
+        dev->ucTxBusError = 0;
+        dev->ucTxArbitLost = 0;
+        dev->readreg (dev, ARBIT_LOST_CAPTURE);
 
-#elif !defined(MAX_INTERRUPTS_PER_ENTRY)
-    while (irqstatus = dev->readreg (dev, INTERRUPT_STATUS))
-#else
-    while ((j--) && (irqstatus = dev->readreg (dev, INTERRUPT_STATUS)))
+        /* request and abort at once make the chip try only once */
+        guarded_write_command (dev, dev->ucTxRequest | ABORT_TRANSMISSION);
+    }
+    else
+        guarded_write_command (dev, dev->ucTxRequest);  /* request a transmission */
+
+    /* keep a copy to send it again if it has to give way to a more urgent one */
+    dev->txCurrent = *img;
+    dev->ucTxState = TX_BUSY;
+
+    /* time the frame spent between the write ioctl, or its launch time, and the chip */
+    dwLatency = (u32) (rtdm_clock_read () - max (img->qwQueued, img->qwLaunch));
+    dev->dwTxRequests++;
+    dev->qwTxLatencyTotalNs += dwLatency;
+    if (dwLatency > dev->dwTxLatencyMaxNs)
+        dev->dwTxLatencyMaxNs = dwLatency;
+}
+
+/**
+ * write a frame bypassing the write fifo, the caller holds chip_lock
+ * returns -EBUSY if the transmit buffer is still occupied
+ */
+int
+sja1000_write_image (struct pcandev *dev, TX_IMAGE * img)
+{
+    if (!(dev->readreg (dev, CHIPSTATUS) & TRANS_BUFFER_STATUS))
+        return -EBUSY;
+
+    /* a frame exceeding its rate has to wait in the queue */
+    if (!pcan_tx_admit (dev, img))
+        return -EBUSY;
+
+    __sja1000_write_image (dev, img);
+    dev->dwTxDirect++;
+
+    return 0;
+}
+
+/**
+ * make room for a frame of class ucClass if a less urgent one still waits in the
+ * transmit buffer, the caller holds chip_lock
+ */
+void
+sja1000_preempt (struct pcandev *dev, u8 ucClass)
+{
+    if (dev->ucTxState != TX_BUSY || dev->txCurrent.ucClass <= ucClass)
+        return;
+
+    /* the transmit interrupt of the frame is already due */
+    if (dev->readreg (dev, CHIPSTATUS) & TRANS_BUFFER_STATUS)
+        return;
+
+    /* a frame already on the bus is not aborted, the transmit interrupt tells which case it was */
+    guarded_write_command (dev, ABORT_TRANSMISSION);
+    dev->ucTxState = TX_ABORTING;
+}
+
+/**
+ * put error frames for frames dropped past their deadline into the read fifo, the caller is its producer
+ */
+static int
+sja1000_report_expired (struct pcandev *dev, int count)
+{
+    struct can_frame ef;
+    nanosecs_abs_t now = rtdm_clock_read ();
+    int result = 0;
+
+    memset (&ef, 0, sizeof (ef));
+    ef.can_id = CAN_ERR_FLAG | CAN_ERR_TX_TIMEOUT;
+    ef.can_dlc = CAN_ERR_DLC;
+
+    while (count--)
+        result = pcan_chardev_rx (dev, &ef, now, now);
+
+    return result;
+}
+
+/**
+ * account for a frame dropped past its deadline, the caller holds chip_lock
+ */
+static void
+sja1000_tx_expired (struct pcandev *dev, TX_IMAGE * img)
+{
+    dev->dwTxExpired++;
+
+    if (img->wCtxId)
+        sja1000_charge_expired (dev, img->wCtxId);
+
+    if (!(img->ucFlags & PCAN_WR_REPORT_EXPIRY))
+        return;
+
+    /* chip_lock serializes the producers of the read fifo only without a service task */
+    if (dev->ucThreaded)
+    {
+        if (dev->wTxExpiredReports < 0xffff)
+            dev->wTxExpiredReports++;
+        rtdm_event_signal (&dev->irq_event);
+    }
+    else if (sja1000_report_expired (dev, 1) > 0)
+        SJA1000_WAKEUP_READ ();
+}
+
+/**
+ * Called by isr 
+ */
+static int
+__sja1000_write (SJA1000_METHOD_ARGS)
+{
+    int result;
+    TX_IMAGE img;
+
+#ifdef PCAN_SJA1000_STATS
+    dev_stats._write_count++;
 #endif
+
+    /* chip_lock held by the caller makes this the only consumer of the transmit queue */
+    /* get a queued frame and step forward, dropping the ones past their deadline */
+    while (!(result = pcan_tx_get (dev, &img)) && img.qwDeadline && img.qwDeadline <= rtdm_clock_read ())
     {
+        sja1000_tx_expired (dev, &img);
+        SJA1000_WAKEUP_WRITE ();
+    }
 
-#ifdef PCAN_SJA1000_DISABLE_IRQ
-        if (!int_disabled)
+    SJA1000_WAKEUP_EMPTY ();
+
+    if (result)
+        return result;
+
+    /* a cell became free for writers waiting on a full queue */
+    SJA1000_WAKEUP_WRITE ();
+
+    /* the frame was marshalled by the writer, only stream it out */
+    __sja1000_write_image (dev, &img);
+
+    return 0;
+}
+
+
+/**
+ * write CAN-data from FIFO to chip, the caller holds chip_lock
+ * returns -EBUSY if the transmit buffer is still occupied
+ */
+int
+sja1000_write (SJA1000_METHOD_ARGS)
+{
+    int err = -EBUSY;
+
+#ifdef PCAN_SJA1000_STATS
+    dev_stats.write_count++;
+#endif
+
+    /* DPRINTK("sja1000_write() %d\n", dev->writeFifo.nStored); */
+
+    /* Check if Tx buffer is empty before writing on */
+    if (dev->readreg (dev, CHIPSTATUS) & TRANS_BUFFER_STATUS)
+    {
+        err = __sja1000_write (dev);
+    }
+
+    return err;
+}
+
+/**
+ * first part of an interrupt: capture the chip's state and leave it ready for the next one
+ */
+static u8
+sja1000_irq_stage (struct pcandev *dev, IRQ_IMAGE * img)
+{
+    u8 irqstatus = dev->readreg (dev, INTERRUPT_STATUS);
+
+    img->ucIrqStatus = irqstatus;
+    img->ucFrames = 0;
+
+    if (!irqstatus)
+        return 0;
+
+    /* DPRINTK("sja1000_irq_stage(0x%02x)\n", irqstatus); */
+
+    dev->dwInterruptCounter++;
+
+    if (irqstatus & DATA_OVERRUN_INTERRUPT)
+        guarded_write_command (dev, CLEAR_DATA_OVERRUN);
+
+    if (irqstatus & RECEIVE_INTERRUPT)
+        sja1000_read_images (dev, img);
+
+    if (irqstatus & (ERROR_PASSIV_INTERRUPT | ERROR_WARN_INTERRUPT))
+        img->ucChipStatus = dev->readreg (dev, CHIPSTATUS);
+
+    if (irqstatus & (BUS_ERROR_INTERRUPT | ERROR_PASSIV_INTERRUPT | ERROR_WARN_INTERRUPT))
+    {
+        img->ucRxErrors = dev->readreg (dev, RX_ERROR_COUNTER);
+        img->ucTxErrors = dev->readreg (dev, TX_ERROR_COUNTER);
+    }
+
+    /* reading the capture register arms it for the next bus error */
+    if (irqstatus & BUS_ERROR_INTERRUPT)
+    {
+        img->ucErrorCode = dev->readreg (dev, ERROR_CODE_CAPTURE);
+
+        if (dev->ucTxState == TX_BUSY && (dev->txCurrent.ucFlags & PCAN_WR_SINGLE_SHOT))
         {
-            sja1000_irq_disable_mask (dev, INTERRUPT_ENABLE_SETUP);
-            int_disabled = 1;
+            dev->ucTxBusError = 1;
+            dev->ucTxErrorCode = img->ucErrorCode;
         }
-#endif
-        /* DPRINTK("sja1000_[base_irqhandler|irqhandler_rt](0x%02x)\n", irqstatus); */
+    }
 
-        dev->dwInterruptCounter++;
-        err = 0;
+    /* the same for the next lost arbitration */
+    if (irqstatus & ARBIT_LOST_INTERRUPT)
+    {
+        img->ucArbitLost = dev->readreg (dev, ARBIT_LOST_CAPTURE) & ARBIT_LOST_BIT_MASK;
 
-        /* quick hack to badly workaround write stall */
-        /* if ((irqstatus & TRANSMIT_INTERRUPT) || (!atomic_read(&dev->DataSendReady) && !pcan_fifo_empty(&dev->writeFifo) && (dev->readreg(dev, CHIPSTATUS) & TRANS_BUFFER_STATUS))) */
-        if (irqstatus & TRANSMIT_INTERRUPT)
+        if (dev->ucTxState == TX_BUSY && (dev->txCurrent.ucFlags & PCAN_WR_SINGLE_SHOT))
         {
-#ifdef PCAN_SJA1000_STATS
-            dev_stats.int_tx_count++;
-#endif
-            /* handle transmission */
-            if ((err = SJA1000_FUNCTION_CALL (__sja1000_write)))
-            {
-                if (err == -ENODATA)
-                    wwakeup++;
-                else
-                {
-                    dev->nLastError = err;
-                    dev->dwErrorCounter++;
-                    dev->wCANStatus |= CAN_ERR_QXMTFULL;        /* fatal error! */
-                }
-            }
-            dev->ucActivityState = ACTIVITY_XMIT;       /* reset to ACTIVITY_IDLE by cyclic timer */
+            dev->ucTxArbitLost = 1;
+            dev->ucTxArbitBit = img->ucArbitLost;
         }
+    }
+
+    return irqstatus;
+}
+
+/**
+ * load the next frame into the transmitter claimed by the caller, who holds chip_lock
+ */
+static void
+sja1000_irq_load (struct pcandev *dev, u16 * wwakeup)
+{
+    int err;
+
+    /* a frame still in the transmit buffer keeps the transmitter, its interrupt loads the next one */
+    if (!(dev->readreg (dev, CHIPSTATUS) & TRANS_BUFFER_STATUS))
+        return;
 
-        if (irqstatus & DATA_OVERRUN_INTERRUPT)
+    while ((err = SJA1000_FUNCTION_CALL (__sja1000_write)))
+    {
+        if (err != -ENODATA && err != -EAGAIN)
         {
-#ifdef PCAN_SJA1000_STATS
-            dev_stats.int_ovr_count++;
-#endif
-            /* handle data overrun */
-            dev->wCANStatus |= CAN_ERR_OVERRUN;
-            ef.can_id |= CAN_ERR_CRTL;
-            ef.data[1] |= CAN_ERR_CRTL_RX_OVERFLOW;
-            rwakeup++;
+            dev->nLastError = err;
             dev->dwErrorCounter++;
+            dev->wCANStatus |= CAN_ERR_QXMTFULL;        /* fatal error! */
+        }
 
-            guarded_write_command (dev, CLEAR_DATA_OVERRUN);
+        /* nothing to send, all waiting frames held back by their shapers or a failure: mark the
+         * transmitter idle before looking at the queue again, a writer publishing a frame
+         * meanwhile is either seen here or finds it idle */
+        atomic_set (&dev->DataSendReady, 1);
+        mb ();
+        if ((err != -ENODATA && err != -EAGAIN) || !pcan_tx_ready (dev)
+            || atomic_cmpxchg (&dev->DataSendReady, 1, 0) != 1)
+        {
+            (*wwakeup)++;
+            break;
+        }
+    }
+}
 
-            /* DPRINTK("%s(%d), DATA_OVR\n", __FUNCTION__, dev->nMinor); */
+/**
+ * report the outcome of a single shot frame, the caller holds chip_lock
+ */
+static int
+sja1000_single_shot_done (struct pcandev *dev)
+{
+    u8 ucArbitBit = 0;
+    u8 ucErrorCode = 0;
+    u8 ucResult;
 
-            dev->ucActivityState = ACTIVITY_XMIT;       /* reset to ACTIVITY_IDLE by cyclic timer */
+    if (dev->readreg (dev, CHIPSTATUS) & TRANS_COMPLETE_STATUS)
+        ucResult = PCAN_TXR_DONE;
+    else
+    {
+        dev->dwTxSingleShotFailed++;
+
+        if (dev->ucTxBusError)
+        {
+            ucResult = PCAN_TXR_BUS_ERROR;
+            ucErrorCode = dev->ucTxErrorCode;
+        }
+        else if (dev->ucTxArbitLost)
+        {
+            ucResult = PCAN_TXR_ARBIT_LOST;
+            ucArbitBit = dev->ucTxArbitBit;
         }
+        else                    /* the capture register may hold an older arbitration */
+            ucResult = PCAN_TXR_NOT_SENT;
+    }
+
+    pcan_tx_report (dev, &dev->txCurrent, ucResult, ucArbitBit, ucErrorCode);
+
+    return ucResult == PCAN_TXR_DONE;
+}
+
+/**
+ * hand the frame just sent back to its writer, stamped with the time of its transmit interrupt
+ */
+static void
+sja1000_tx_echo (struct pcandev *dev, nanosecs_abs_t qwTimestamp)
+{
+    TPCANEcho echo;
+    struct can_frame cf;
 
-        if (irqstatus & RECEIVE_INTERRUPT)
+    sja1000_decode_image (dev->txCurrent.ucImage, &cf);
+    frame2msg (&cf, &echo.Msg);
+    echo.dwTag = dev->txCurrent.dwTag;
+    echo.qwTimestamp = qwTimestamp;
+
+    sja1000_echo (dev, &echo, dev->txCurrent.wCtxId);
+}
+
+/**
+ * push the next frame after a transmit interrupt, the caller holds chip_lock
+ */
+static void
+sja1000_irq_transmit (struct pcandev *dev, nanosecs_abs_t qwTimestamp, u16 * wwakeup)
+{
+    int sent = 0;
+
+#ifdef PCAN_SJA1000_STATS
+    dev_stats.int_tx_count++;
+#endif
+    /* the transmit buffer is free again, an aborted frame goes back ahead of its class */
+    if (dev->ucTxState == TX_ABORTING)
+    {
+        if (dev->readreg (dev, CHIPSTATUS) & TRANS_COMPLETE_STATUS)
+        {
+            dev->ucTxState = TX_IDLE;   /* it was on the bus already */
+            sent = 1;
+        }
+        else
         {
+            dev->ucTxState = TX_REQUEUED;
+            dev->dwTxAborts++;
+        }
+    }
+    else if (dev->ucTxState == TX_BUSY)
+    {
+        /* with automatic retransmission the transmit interrupt means the frame was sent */
+        sent = (dev->txCurrent.ucFlags & PCAN_WR_SINGLE_SHOT) ? sja1000_single_shot_done (dev) : 1;
+        dev->ucTxState = TX_IDLE;
+    }
+
+    if (sent && (dev->txCurrent.ucFlags & PCAN_WR_ECHO))
+        sja1000_tx_echo (dev, qwTimestamp);
+
+    /* the transmitter belongs to the completed frame unless it was handed back already, e.g. by a
+     * reconfiguration which cut the frame off; then it has to be claimed like any writer does */
+    if (!atomic_read (&dev->DataSendReady) || atomic_cmpxchg (&dev->DataSendReady, 1, 0) == 1)
+        sja1000_irq_load (dev, wwakeup);
+    dev->ucActivityState = ACTIVITY_XMIT;       /* reset to ACTIVITY_IDLE by cyclic timer */
+}
+
+/**
+ * load the transmitter from the queues after frames were queued at reception, the caller holds chip_lock
+ */
+static void
+sja1000_irq_kick (struct pcandev *dev, u16 * wwakeup)
+{
+    dev->ucTxKick = 0;
+
+    /* a busy transmitter gets loaded by its next transmit interrupt */
+    if (atomic_cmpxchg (&dev->DataSendReady, 1, 0) == 1)
+        sja1000_irq_load (dev, wwakeup);
+}
+
+/**
+ * count a bus error by its type, direction and location and describe it in an error frame
+ */
+static void
+sja1000_bus_error (struct pcandev *dev, u8 ucErrorCode, struct can_frame *ef)
+{
+    u8 ucSegment = ucErrorCode & ERROR_SEGMENT_MASK;
+
+    ef->can_id |= CAN_ERR_PROT | CAN_ERR_BUSERROR;
+
+    switch (ucErrorCode & ERROR_CODE_MASK)
+    {
+    case ERROR_CODE_BIT:
+        dev->dwBitErrors++;
+        ef->data[2] |= CAN_ERR_PROT_BIT;
+        break;
+    case ERROR_CODE_FORM:
+        dev->dwFormErrors++;
+        ef->data[2] |= CAN_ERR_PROT_FORM;
+        break;
+    case ERROR_CODE_STUFF:
+        dev->dwStuffErrors++;
+        ef->data[2] |= CAN_ERR_PROT_STUFF;
+        break;
+    default:
+        dev->dwOtherErrors++;
+        break;
+    }
+
+    /* missing or broken nodes show up in the acknowledge, noise in the CRC */
+    if (ucSegment == CAN_ERR_PROT_LOC_ACK || ucSegment == CAN_ERR_PROT_LOC_ACK_DEL)
+        dev->dwAckErrors++;
+    else if (ucSegment == CAN_ERR_PROT_LOC_CRC_SEQ || ucSegment == CAN_ERR_PROT_LOC_CRC_DEL)
+        dev->dwCrcErrors++;
+
+    if (!(ucErrorCode & ERROR_DIRECTION_RX))
+    {
+        dev->dwTxBusErrors++;
+        ef->data[2] |= CAN_ERR_PROT_TX;
+    }
+
+    ef->data[3] = ucSegment;
+}
+
+/**
+ * put the frames of an interrupt into the read fifo, whose only producer the caller is;
+ * returns the result of sja1000_queue_frames() for sja1000_irq_status()
+ */
+static int
+sja1000_irq_receive (struct pcandev *dev, IRQ_IMAGE * img, u16 * rwakeup)
+{
+    int err = 0;
+
+    if (img->ucIrqStatus & RECEIVE_INTERRUPT)
+    {
 #ifdef PCAN_SJA1000_STATS
-            dev_stats.int_rx_count++;
+        dev_stats.int_rx_count++;
 #endif
-            /* handle receiption */
-            if ((err = SJA1000_FUNCTION_CALL (sja1000_read_frames)) < 0)        /* put to input queues */
-            {
-                dev->nLastError = err;
-                dev->dwErrorCounter++;
-                dev->wCANStatus |= CAN_ERR_QOVERRUN;
+        /* handle receiption, the receive buffer was already released while staging */
+        err = sja1000_queue_frames (dev, img);  /* put to input queues */
 
-                /* throw away last message which was refused by fifo */
-                guarded_write_command (dev, RELEASE_RECEIVE_BUFFER);
-            }
+        if (err > 0)            /* successfully enqueued into chardev FIFO */
+            (*rwakeup)++;
+    }
 
-            if (err > 0)        /* successfully enqueued into chardev FIFO */
-                rwakeup++;
+    return err;
+}
 
-            dev->ucActivityState = ACTIVITY_XMIT;       /* reset to ACTIVITY_IDLE by cyclic timer */
-        }
+/**
+ * update the status of the device after an interrupt and describe its errors in ef,
+ * the caller holds chip_lock as the top half, the watchdog and the status ioctls change it too
+ */
+static void
+sja1000_irq_status (struct pcandev *dev, IRQ_IMAGE * img, int rxerr, struct can_frame *ef,
+                    u16 * rwakeup, u16 * wwakeup)
+{
+    u8 irqstatus = img->ucIrqStatus;
+
+    if (irqstatus & DATA_OVERRUN_INTERRUPT)
+    {
+#ifdef PCAN_SJA1000_STATS
+        dev_stats.int_ovr_count++;
+#endif
+        /* handle data overrun */
+        dev->wCANStatus |= CAN_ERR_OVERRUN;
+        ef->can_id |= CAN_ERR_CRTL;
+        ef->data[1] |= CAN_ERR_CRTL_RX_OVERFLOW;
+        (*rwakeup)++;
+        dev->dwErrorCounter++;
+
+        /* DPRINTK("%s(%d), DATA_OVR\n", __FUNCTION__, dev->nMinor); */
+
+        dev->ucActivityState = ACTIVITY_XMIT;   /* reset to ACTIVITY_IDLE by cyclic timer */
+    }
 
-        if (irqstatus & (BUS_ERROR_INTERRUPT | ERROR_PASSIV_INTERRUPT | ERROR_WARN_INTERRUPT))
+    if (irqstatus & RECEIVE_INTERRUPT)
+    {
+        if (rxerr < 0)
         {
+            dev->nLastError = rxerr;
+            dev->dwErrorCounter++;
+            dev->wCANStatus |= CAN_ERR_QOVERRUN;
+        }
+
+        dev->ucActivityState = ACTIVITY_XMIT;   /* reset to ACTIVITY_IDLE by cyclic timer */
+    }
+
+    if (irqstatus & (BUS_ERROR_INTERRUPT | ERROR_PASSIV_INTERRUPT | ERROR_WARN_INTERRUPT))
+    {
 #ifdef PCAN_SJA1000_STATS
-            dev_stats.int_err_count++;
+        dev_stats.int_err_count++;
 #endif
-            /* DPRINTK("%s(%d), irqstatus=%02Xh\n", __FUNCTION__, dev->nMinor, irqstatus); */
+        /* DPRINTK("%s(%d), irqstatus=%02Xh\n", __FUNCTION__, dev->nMinor, irqstatus); */
 
-            if (irqstatus & (ERROR_PASSIV_INTERRUPT | ERROR_WARN_INTERRUPT))
-            {
-                u8 chipstatus = dev->readreg (dev, CHIPSTATUS);
+        if (irqstatus & (ERROR_PASSIV_INTERRUPT | ERROR_WARN_INTERRUPT))
+        {
+            u8 chipstatus = img->ucChipStatus;
 
-                /* DPRINTK("sja1000_irqhandler(), chipstatus=0x%02x\n", chipstatus); */
-                switch (chipstatus & (BUS_STATUS | ERROR_STATUS))
+            /* DPRINTK("sja1000_irqhandler(), chipstatus=0x%02x\n", chipstatus); */
+            switch (chipstatus & (BUS_STATUS | ERROR_STATUS))
+            {
+            case 0x00:
+                /* error active, clear only local status */
+                dev->busStatus = CAN_ERROR_ACTIVE;
+                DPRINTK ("sja1000_irqhandler(), busStatus=CAN_ERROR_ACTIVE (1)\n");
+                dev->wCANStatus &= ~(CAN_ERR_BUSOFF | CAN_ERR_BUSHEAVY | CAN_ERR_BUSLIGHT);
+                break;
+            case BUS_STATUS:
+            case BUS_STATUS | ERROR_STATUS:
+                /* bus-off */
+                dev->busStatus = CAN_BUS_OFF;
+                dev->wCANStatus |= CAN_ERR_BUSOFF;
+                ef->can_id |= CAN_ERR_BUSOFF_NETDEV;
+                DPRINTK ("sja1000_irqhandler(), busStatus=CAN_BUS_OFF\n");
+                break;
+            case ERROR_STATUS:
+                if (irqstatus & ERROR_PASSIV_INTERRUPT)
                 {
-                case 0x00:
-                    /* error active, clear only local status */
-                    dev->busStatus = CAN_ERROR_ACTIVE;
-                    DPRINTK ("sja1000_irqhandler(), busStatus=CAN_ERROR_ACTIVE (1)\n");
-                    dev->wCANStatus &= ~(CAN_ERR_BUSOFF | CAN_ERR_BUSHEAVY | CAN_ERR_BUSLIGHT);
-                    break;
-                case BUS_STATUS:
-                case BUS_STATUS | ERROR_STATUS:
-                    /* bus-off */
-                    dev->busStatus = CAN_BUS_OFF;
-                    dev->wCANStatus |= CAN_ERR_BUSOFF;
-                    ef.can_id |= CAN_ERR_BUSOFF_NETDEV;
-                    DPRINTK ("sja1000_irqhandler(), busStatus=CAN_BUS_OFF\n");
-                    break;
-                case ERROR_STATUS:
-                    if (irqstatus & ERROR_PASSIV_INTERRUPT)
+                    /* either enter or leave error passive status */
+                    if (dev->busStatus == CAN_ERROR_PASSIVE)
                     {
-                        /* either enter or leave error passive status */
-                        if (dev->busStatus == CAN_ERROR_PASSIVE)
-                        {
-                            /* go back to error active */
-                            dev->busStatus = CAN_ERROR_ACTIVE;
-                            dev->wCANStatus &= ~(CAN_ERR_BUSOFF | CAN_ERR_BUSHEAVY);
-                            dev->wCANStatus |= CAN_ERR_BUSLIGHT;
-                            DPRINTK ("sja1000_irqhandler(), busStatus=CAN_ERROR_ACTIVE (2)\n");
-                        }
-                        else
-                        {
-                            /* enter error passive state */
-                            dev->busStatus = CAN_ERROR_PASSIVE;
-                            dev->wCANStatus &= ~CAN_ERR_BUSOFF;
-                            dev->wCANStatus |= CAN_ERR_BUSHEAVY;
-                            ef.can_id |= CAN_ERR_CRTL;
-                            ef.data[1] |= (CAN_ERR_CRTL_RX_PASSIVE | CAN_ERR_CRTL_TX_PASSIVE);
-                            DPRINTK ("sja1000_irqhandler(), busStatus=CAN_ERROR_PASSIVE\n");
-                        }
+                        /* go back to error active */
+                        dev->busStatus = CAN_ERROR_ACTIVE;
+                        dev->wCANStatus &= ~(CAN_ERR_BUSOFF | CAN_ERR_BUSHEAVY);
+                        dev->wCANStatus |= CAN_ERR_BUSLIGHT;
+                        DPRINTK ("sja1000_irqhandler(), busStatus=CAN_ERROR_ACTIVE (2)\n");
                     }
                     else
                     {
-                        /* it was a warning limit reached event */
-                        dev->busStatus = CAN_ERROR_ACTIVE;
-                        dev->wCANStatus |= CAN_ERR_BUSLIGHT;
-                        ef.can_id |= CAN_ERR_CRTL;
-                        ef.data[1] |= (CAN_ERR_CRTL_RX_WARNING | CAN_ERR_CRTL_TX_WARNING);
-                        DPRINTK ("sja1000_irqhandler(), busStatus=CAN_ERROR_ACTIVE (3)\n");
+                        /* enter error passive state */
+                        dev->busStatus = CAN_ERROR_PASSIVE;
+                        dev->wCANStatus &= ~CAN_ERR_BUSOFF;
+                        dev->wCANStatus |= CAN_ERR_BUSHEAVY;
+                        ef->can_id |= CAN_ERR_CRTL;
+                        ef->data[1] |= (CAN_ERR_CRTL_RX_PASSIVE | CAN_ERR_CRTL_TX_PASSIVE);
+                        DPRINTK ("sja1000_irqhandler(), busStatus=CAN_ERROR_PASSIVE\n");
                     }
-                    break;
                 }
+                else
+                {
+                    /* it was a warning limit reached event */
+                    dev->busStatus = CAN_ERROR_ACTIVE;
+                    dev->wCANStatus |= CAN_ERR_BUSLIGHT;
+                    ef->can_id |= CAN_ERR_CRTL;
+                    ef->data[1] |= (CAN_ERR_CRTL_RX_WARNING | CAN_ERR_CRTL_TX_WARNING);
+                    DPRINTK ("sja1000_irqhandler(), busStatus=CAN_ERROR_ACTIVE (3)\n");
+                }
+                break;
             }
-
-            /* count each error signal even if it does not change any bus or error state */
-            dev->dwErrorCounter++;
-
-            /* wake up pending reads or writes */
-            rwakeup++;
-            wwakeup++;
-            dev->ucActivityState = ACTIVITY_XMIT;       /* reset to ACTIVITY_IDLE by cyclic timer */
         }
 
-        /* if an error condition occurred, send an error frame to the userspace */
-        if (ef.can_id)
-        {
-            struct timeval tv;
-
-            DO_GETTIMEOFDAY (tv);       /* create timestamp */
+        if (irqstatus & BUS_ERROR_INTERRUPT)
+            sja1000_bus_error (dev, img->ucErrorCode, ef);
 
-            ef.can_id |= CAN_ERR_FLAG;
-            ef.can_dlc = CAN_ERR_DLC;
+        /* count each error signal even if it does not change any bus or error state */
+        dev->dwErrorCounter++;
 
-            SJA1000_LOCK_IRQSAVE (in_lock);
-
-            if (pcan_chardev_rx (dev, &ef, &tv) > 0)    /* put into specific data sink */
-                rwakeup++;
+        /* wake up pending reads or writes */
+        (*rwakeup)++;
+        (*wwakeup)++;
+        dev->ucActivityState = ACTIVITY_XMIT;   /* reset to ACTIVITY_IDLE by cyclic timer */
+    }
 
-            SJA1000_UNLOCK_IRQRESTORE (in_lock);
+    if (irqstatus & ARBIT_LOST_INTERRUPT)
+    {
+        dev->dwArbitLost++;
+        ef->can_id |= CAN_ERR_LOSTARB;
+        ef->data[0] = img->ucArbitLost;
+    }
 
-            memset (&ef, 0, sizeof (ef));       /* clear for next loop */
-        }
+    /* bus errors and lost arbitrations alone are left to the counters unless asked for */
+    if (!(dev->ucListenOnly & PCAN_INIT_ERROR_REPORTS))
+    {
+        ef->can_id &= ~(CAN_ERR_PROT | CAN_ERR_BUSERROR | CAN_ERR_LOSTARB);
+        ef->data[0] = ef->data[2] = ef->data[3] = 0;
+    }
 
-        ret = SJA1000_IRQ_HANDLED;
+    if (ef->can_id && (irqstatus & (BUS_ERROR_INTERRUPT | ERROR_PASSIV_INTERRUPT | ERROR_WARN_INTERRUPT)))
+    {
+        ef->can_id |= CAN_ERR_CNT;
+        ef->data[6] = img->ucTxErrors;
+        ef->data[7] = img->ucRxErrors;
     }
+}
 
-#ifdef PCAN_SJA1000_DISABLE_IRQ
-    if (int_disabled)
+/**
+ * if an error condition occurred, send an error frame to the userspace, the caller is the producer of the read fifo
+ */
+static void
+sja1000_irq_error_frame (struct pcandev *dev, IRQ_IMAGE * img, struct can_frame *ef, u16 * rwakeup)
+{
+    if (ef->can_id)
     {
-        /* sja1000_irq_enable(dev); */
-        sja1000_irq_enable_mask (dev, INTERRUPT_ENABLE_SETUP);
+        ef->can_id |= CAN_ERR_FLAG;
+        ef->can_dlc = CAN_ERR_DLC;
+
+        if (pcan_chardev_rx (dev, ef, img->qwTimestamp, img->qwTimestamp) > 0)        /* put into specific data sink */
+            (*rwakeup)++;
     }
-#endif
+}
+
+/**
+ * second part of an interrupt: everything left which does not access the chip, the caller holds chip_lock
+ */
+static void
+sja1000_irq_service (struct pcandev *dev, IRQ_IMAGE * img, u16 * rwakeup, u16 * wwakeup)
+{
+    struct can_frame ef;
+    int err;
+
+    memset (&ef, 0, sizeof (ef));
 
-    SJA1000_UNLOCK_IRQRESTORE (sja_lock);
+    err = sja1000_irq_receive (dev, img, rwakeup);
+    sja1000_irq_status (dev, img, err, &ef, rwakeup, wwakeup);
+    sja1000_irq_error_frame (dev, img, &ef, rwakeup);
+}
 
+/**
+ * wake up whoever waits for the results of one or more interrupts
+ */
+static void
+sja1000_irq_wakeup (struct pcandev *dev, u16 rwakeup, u16 wwakeup)
+{
     if (wwakeup)
     {
 #ifdef PCAN_SJA1000_STATS
         dev_stats.wakup_w_count++;
 #endif
-        atomic_set (&dev->DataSendReady, 1);    /* signal I'm ready to write */
-        /* wmb(); */
+        /* the transmitter itself is only handed back by sja1000_irq_load() */
         SJA1000_WAKEUP_WRITE ();
 #ifdef NETDEV_SUPPORT
         if (dev->netdev)
@@ -917,10 +1532,330 @@ sja1000_irqhandler_common (SJA1000_METHOD_ARGS)
 #endif
         SJA1000_WAKEUP_READ ();
     }
+}
+
+/**
+ * read the error counters of the chip
+ */
+void
+sja1000_error_counters (struct pcandev *dev, u8 * ucRxErrors, u8 * ucTxErrors)
+{
+    SJA1000_LOCK_IRQSAVE (chip_lock);
+
+    *ucRxErrors = dev->readreg (dev, RX_ERROR_COUNTER);
+    *ucTxErrors = dev->readreg (dev, TX_ERROR_COUNTER);
+
+    SJA1000_UNLOCK_IRQRESTORE (chip_lock);
+}
+
+/**
+ * look for a transmitter without progress since the last call, which is recovered if the stall is
+ * seen twice in a row: either the transmit buffer is free but its interrupt never came, or frames are
+ * ready but nobody loads the idle transmitter. Returns 1 if the transmit path was kicked.
+ */
+int
+sja1000_tx_watchdog (SJA1000_METHOD_ARGS)
+{
+    int stalled = 0;
+    int recovered = 0;
+    u16 wwakeup = 0;
+
+    SJA1000_LOCK_IRQSAVE (chip_lock);
+
+    if (dev->dwTxRequests == dev->dwTxWatchdogSeen)
+    {
+        if (!atomic_read (&dev->DataSendReady))
+            /* a staged interrupt not serviced yet is no stall */
+            stalled = (dev->ucTxState == TX_BUSY || dev->ucTxState == TX_ABORTING)
+                && (!dev->ucThreaded || pcan_fifo_empty (&dev->irqFifo))
+                && (dev->readreg (dev, CHIPSTATUS) & TRANS_BUFFER_STATUS);
+        else
+            /* released, so no frame of ours may be in the buffer, and the buffer must be free */
+            stalled = (dev->ucTxState == TX_IDLE || dev->ucTxState == TX_REQUEUED)
+                && (dev->readreg (dev, CHIPSTATUS) & TRANS_BUFFER_STATUS)
+                && pcan_tx_ready (dev);
+    }
+
+    if (stalled && dev->ucTxStallSuspect)
+    {
+        if (!atomic_read (&dev->DataSendReady))
+        {
+            sja1000_irq_transmit (dev, rtdm_clock_read (), &wwakeup);
+            recovered = 1;
+        }
+        else if (atomic_cmpxchg (&dev->DataSendReady, 1, 0) == 1)
+        {
+            sja1000_irq_load (dev, &wwakeup);
+            recovered = 1;
+        }
+
+        if (recovered)
+            dev->dwTxStallRecoveries++;
+        stalled = 0;
+    }
+
+    dev->ucTxStallSuspect = stalled;
+    dev->dwTxWatchdogSeen = dev->dwTxRequests;
+
+    SJA1000_UNLOCK_IRQRESTORE (chip_lock);
+
+    sja1000_irq_wakeup (dev, 0, wwakeup);
+
+    return recovered;
+}
+
+/**
+ * the service task of threaded interrupt handling, does all the work the
+ * top half left in the staging fifo
+ */
+static void
+sja1000_irq_task (void *arg)
+{
+    struct pcandev *dev = (struct pcandev *) arg;
+    IRQ_IMAGE img;
+    struct can_frame ef;
+    u16 rwakeup;
+    u16 wwakeup;
+    int err;
+
+#ifdef CONFIG_SMP
+    if (irq_thread_cpu >= 0)
+        xnpod_migrate_thread (irq_thread_cpu);
+#endif
+
+    while (!rtdm_task_should_stop ())
+    {
+        if (rtdm_event_wait (&dev->irq_event))
+            break;
+
+        rwakeup = 0;
+        wwakeup = 0;
+
+        /* the top half is the only producer, this task the only consumer */
+        while (!pcan_fifo_get (&dev->irqFifo, &img))
+        {
+            if (img.ucIrqStatus & TRANSMIT_INTERRUPT)
+            {
+                SJA1000_LOCK_IRQSAVE (chip_lock);
+                sja1000_irq_transmit (dev, img.qwTimestamp, &wwakeup);
+                SJA1000_UNLOCK_IRQRESTORE (chip_lock);
+            }
+
+            /* the read fifo is filled without chip_lock, only the shared status needs it */
+            memset (&ef, 0, sizeof (ef));
+            err = sja1000_irq_receive (dev, &img, &rwakeup);
+
+            SJA1000_LOCK_IRQSAVE (chip_lock);
+            sja1000_irq_status (dev, &img, err, &ef, &rwakeup, &wwakeup);
+            if (dev->ucTxKick)
+                sja1000_irq_kick (dev, &wwakeup);
+            SJA1000_UNLOCK_IRQRESTORE (chip_lock);
+
+            sja1000_irq_error_frame (dev, &img, &ef, &rwakeup);
+        }
+
+        /* error frames for expired frames, this task is the producer of the read fifo */
+        if (dev->wTxExpiredReports)
+        {
+            u16 reports;
+
+            SJA1000_LOCK_IRQSAVE (chip_lock);
+            reports = dev->wTxExpiredReports;
+            dev->wTxExpiredReports = 0;
+            SJA1000_UNLOCK_IRQRESTORE (chip_lock);
+
+            if (sja1000_report_expired (dev, reports) > 0)
+                rwakeup++;
+        }
+
+        /* a transmit interrupt lost to a full staging fifo must not stall the writers */
+        if (dev->ucLostIrqStatus)
+        {
+            SJA1000_LOCK_IRQSAVE (chip_lock);
+            if (dev->ucLostIrqStatus & TRANSMIT_INTERRUPT)
+                sja1000_irq_transmit (dev, rtdm_clock_read (), &wwakeup);   /* the time is lost too */
+            dev->ucLostIrqStatus = 0;
+            SJA1000_UNLOCK_IRQRESTORE (chip_lock);
+        }
+
+        sja1000_irq_wakeup (dev, rwakeup, wwakeup);
+    }
+}
+
+/**
+ * start threaded interrupt handling for a device if configured, before its interrupt is enabled
+ */
+int
+sja1000_start_irq_task (struct pcandev *dev)
+{
+    char name[16];
+    int err;
+
+    if (!irq_thread)
+        return 0;
+
+    pcan_fifo_reset (&dev->irqFifo);
+    dev->ucLostIrqStatus = 0;
+
+    snprintf (name, sizeof (name), "%s%d_irq", DEVICE_NAME, dev->nMinor);
+    err = rtdm_task_init (&dev->irq_task, name, sja1000_irq_task, dev, irq_thread_prio, 0);
+    if (err)
+        return err;
+
+    dev->ucThreaded = 1;
+
+    return 0;
+}
+
+/**
+ * stop threaded interrupt handling, after the interrupt was disabled
+ */
+void
+sja1000_stop_irq_task (struct pcandev *dev)
+{
+    if (!dev->ucThreaded)
+        return;
+
+    dev->ucThreaded = 0;
+    rtdm_task_destroy (&dev->irq_task);
+}
+
+/**
+ * the top half of threaded interrupt handling, hands the chip's state over to the service task
+ */
+static int
+sja1000_irqhandler_staged (struct pcandev *dev, IRQ_IMAGE * img)
+{
+    int ret = SJA1000_IRQ_NONE;
+#ifdef MAX_INTERRUPTS_PER_ENTRY
+    int j = MAX_INTERRUPTS_PER_ENTRY;
+#endif
+
+    SJA1000_LOCK_IRQSAVE (chip_lock);
+
+#if defined(PCAN_SJA1000_DONT_LOOP_ON_ISR)
+    if (sja1000_irq_stage (dev, img))
+#elif !defined(MAX_INTERRUPTS_PER_ENTRY)
+    while (sja1000_irq_stage (dev, img))
+#else
+    while ((j--) && sja1000_irq_stage (dev, img))
+#endif
+    {
+        if (pcan_fifo_put (&dev->irqFifo, img))
+        {
+            /* the frames are lost, the service task catches up on transmission */
+            dev->dwStageOverruns++;
+            dev->wCANStatus |= CAN_ERR_QOVERRUN;
+            dev->ucLostIrqStatus |= img->ucIrqStatus;
+        }
+
+        ret = SJA1000_IRQ_HANDLED;
+    }
+
+    SJA1000_UNLOCK_IRQRESTORE (chip_lock);
+
+    if (ret == SJA1000_IRQ_HANDLED)
+        rtdm_event_signal (&dev->irq_event);
+
+    return ret;
+}
+
+/**
+ * account the time spent in the interrupt handler since qwEntry
+ */
+static inline void
+sja1000_account_isr (struct pcandev *dev, nanosecs_abs_t qwEntry)
+{
+    u32 dwNs = (u32) (rtdm_clock_read () - qwEntry);
+
+    dev->dwIsrCount++;
+    dev->qwIsrTotalNs += dwNs;
+    if (dwNs > dev->dwIsrMaxNs)
+        dev->dwIsrMaxNs = dwNs;
+}
+
+/**
+ * handle a interrupt request
+ */
+int
+sja1000_irqhandler_common (SJA1000_METHOD_ARGS)
+{
+    int ret = SJA1000_IRQ_NONE;
+    u16 rwakeup = 0;
+    u16 wwakeup = 0;
+#ifdef MAX_INTERRUPTS_PER_ENTRY
+    /* except the Rx flag, but this is processed by polling the Rx BUFFER */
+    /* STATUS reg bit */
+    int j = MAX_INTERRUPTS_PER_ENTRY;
+#endif
+#ifdef PCAN_SJA1000_DISABLE_IRQ
+    int int_disabled = 0;
+#endif
+    IRQ_IMAGE img;
+
+    img.qwTimestamp = rtdm_clock_read ();       /* one timestamp for all frames of this interrupt */
+
+    /* DPRINTK("sja1000_base_irqhandler|sja1000_irqhandler_rt()\n"); */
+
+#ifdef PCAN_SJA1000_STATS
+    dev_stats.int_count++;
+#endif
+
+    if (dev->ucThreaded)
+    {
+        ret = sja1000_irqhandler_staged (dev, &img);
+        if (ret == SJA1000_IRQ_HANDLED)
+            sja1000_account_isr (dev, img.qwTimestamp);
+        return ret;
+    }
 
-#ifdef PCAN_SJA1000_USES_ISR_LOCK
-    SPIN_UNLOCK_IRQRESTORE (&dev->isr_lock);
+    /* the fifos are handed over lock free; the mailboxes, the context list and the transmit
+     * matrix have locks of their own, which may be taken while holding chip_lock */
+    SJA1000_LOCK_IRQSAVE (chip_lock);
+
+#if defined(PCAN_SJA1000_DONT_LOOP_ON_ISR)
+    if (sja1000_irq_stage (dev, &img))
+#elif !defined(MAX_INTERRUPTS_PER_ENTRY)
+    while (sja1000_irq_stage (dev, &img))
+#else
+    while ((j--) && sja1000_irq_stage (dev, &img))
 #endif
+    {
+
+#ifdef PCAN_SJA1000_DISABLE_IRQ
+        if (!int_disabled)
+        {
+            sja1000_irq_disable_mask (dev, INTERRUPT_ENABLE_SETUP);
+            int_disabled = 1;
+        }
+#endif
+
+        /* a transmit interrupt which never comes is caught by sja1000_tx_watchdog() */
+        if (img.ucIrqStatus & TRANSMIT_INTERRUPT)
+            sja1000_irq_transmit (dev, img.qwTimestamp, &wwakeup);
+
+        sja1000_irq_service (dev, &img, &rwakeup, &wwakeup);
+
+        if (dev->ucTxKick)
+            sja1000_irq_kick (dev, &wwakeup);
+
+        ret = SJA1000_IRQ_HANDLED;
+    }
+
+#ifdef PCAN_SJA1000_DISABLE_IRQ
+    if (int_disabled)
+    {
+        /* sja1000_irq_enable(dev); */
+        sja1000_irq_enable_mask (dev, dev->ucIrqEnable);
+    }
+#endif
+
+    SJA1000_UNLOCK_IRQRESTORE (chip_lock);
+
+    sja1000_irq_wakeup (dev, rwakeup, wwakeup);
+
+    if (ret == SJA1000_IRQ_HANDLED)
+        sja1000_account_isr (dev, img.qwTimestamp);
 
     return ret;
 }
@@ -27,11 +27,18 @@
 
 int sja1000_open (struct pcandev *dev, u16 btr0btr1, u8 bExtended, u8 bListenOnly);
 void sja1000_release (struct pcandev *dev);
+int sja1000_reconfigure (struct pcandev *dev, u16 btr0btr1, u8 bExtended, u8 bListenOnly);
 
-int sja1000_write (struct pcandev *dev, struct pcanctx_rt *ctx);
-int sja1000_irqhandler_rt (rtdm_irq_t * irq_context);
-int sja1000_irqhandler_common (struct pcandev *dev, struct pcanctx_rt *ctx);
-int sja1000_write_frame (struct pcandev *dev, struct can_frame *cf);
+int sja1000_write (struct pcandev *dev);
+int sja1000_irqhandler_common (struct pcandev *dev);
+int sja1000_start_irq_task (struct pcandev *dev);
+void sja1000_stop_irq_task (struct pcandev *dev);
+void sja1000_marshal (struct can_frame *cf, TX_IMAGE * img);
+int sja1000_write_image (struct pcandev *dev, TX_IMAGE * img);
+void sja1000_preempt (struct pcandev *dev, u8 ucClass);
+int sja1000_tx_watchdog (struct pcandev *dev);
+void sja1000_error_counters (struct pcandev *dev, u8 * ucRxErrors, u8 * ucTxErrors);
+void sja1000_decode_image (u8 * image, struct can_frame *frame);
 
 int sja1000_probe (struct pcandev *dev);
 u16 sja1000_bitrate (u32 dwBitRate);
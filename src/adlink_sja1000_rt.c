@@ -22,32 +22,75 @@
 #define SJA1000_IRQ_HANDLED RTDM_IRQ_HANDLED
 #define SJA1000_IRQ_NONE RTDM_IRQ_NONE
 
-#define SJA1000_METHOD_ARGS struct pcandev *dev, struct pcanctx_rt *ctx
+#define SJA1000_METHOD_ARGS struct pcandev *dev
 
 #define SJA1000_LOCK_DECLARE
 #define SJA1000_LOCK_INIT(type)
 #define SJA1000_LOCK_IRQSAVE(type) {rtdm_lockctx_t lockctx;\
-                                 rtdm_lock_get_irqsave(&ctx->type, lockctx)
-#define SJA1000_UNLOCK_IRQRESTORE(type) rtdm_lock_put_irqrestore(&ctx->type, lockctx);}
+                                 pcan_lock_get_irqsave(&dev->type, &lockctx)
+#define SJA1000_UNLOCK_IRQRESTORE(type) pcan_lock_put_irqrestore(&dev->type, &lockctx);}
 
-#define SJA1000_WAKEUP_READ() rtdm_event_signal(&ctx->in_event)
-#define SJA1000_WAKEUP_WRITE() rtdm_event_signal(&ctx->out_event)
+#define SJA1000_WAKEUP_READ() sja1000_wakeup_readers(dev)
+#define SJA1000_WAKEUP_WRITE() rtdm_event_signal(&dev->out_event)
 #define SJA1000_WAKEUP_EMPTY() if(result == -ENODATA)\
-                                  rtdm_event_signal(&ctx->empty_event)
+                                  rtdm_event_signal(&dev->empty_event)
 
-#define SJA1000_FUNCTION_CALL(name) name(dev,ctx)
+#define SJA1000_FUNCTION_CALL(name) name(dev)
 
-//****************************************************************************
-// CODE
+/* charge a frame dropped past its deadline to the context which wrote it */
+static void
+sja1000_charge_expired (struct pcandev *dev, u16 wCtxId)
+{
+    struct list_head *ptr;
+    struct pcanctx_rt *ctx;
+    rtdm_lockctx_t lockctx;
+
+    rtdm_lock_get_irqsave (&dev->ctx_lock, lockctx);
+    list_for_each (ptr, &dev->ctx_list)
+    {
+        ctx = list_entry (ptr, struct pcanctx_rt, list);
+        if (ctx->wCtxId == wCtxId)
+        {
+            ctx->dwTxExpired++;
+            break;
+        }
+    }
+    rtdm_lock_put_irqrestore (&dev->ctx_lock, lockctx);
+}
 
-int
-sja1000_irqhandler_rt (rtdm_irq_t * irq_context)
+/* hand a frame sent back to the context which wrote it */
+static void
+sja1000_echo (struct pcandev *dev, TPCANEcho * echo, u16 wCtxId)
 {
+    struct list_head *ptr;
     struct pcanctx_rt *ctx;
-    struct pcandev *dev;
+    rtdm_lockctx_t lockctx;
 
-    ctx = rtdm_irq_get_arg (irq_context, struct pcanctx_rt);
-    dev = ctx->dev;
+    rtdm_lock_get_irqsave (&dev->ctx_lock, lockctx);
+    list_for_each (ptr, &dev->ctx_list)
+    {
+        ctx = list_entry (ptr, struct pcanctx_rt, list);
+        if (ctx->wCtxId == wCtxId)
+        {
+            if (pcan_fifo_put (&ctx->echoFifo, echo))
+                ctx->dwEchoLost++;
+            else
+                rtdm_event_signal (&ctx->echo_event);
+            break;
+        }
+    }
+    rtdm_lock_put_irqrestore (&dev->ctx_lock, lockctx);
+}
+
+/* received messages are announced to every context opened on the device */
+static void
+sja1000_wakeup_readers (struct pcandev *dev)
+{
+    struct list_head *ptr;
+    rtdm_lockctx_t lockctx;
 
-    return sja1000_irqhandler_common (dev, ctx);
+    rtdm_lock_get_irqsave (&dev->ctx_lock, lockctx);
+    list_for_each (ptr, &dev->ctx_list)
+        rtdm_event_signal (&list_entry (ptr, struct pcanctx_rt, list)->in_event);
+    rtdm_lock_put_irqrestore (&dev->ctx_lock, lockctx);
 }
@@ -0,0 +1,576 @@
+/* 
+ * Driver for dual-port isolated CAN interface card
+ * Copyright (C) 2011  Peter Kotvan <peter.kotvan@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Manages the queue of frames to transmit
+ */
+
+#include <adlink_common.h>
+#include <linux/kernel.h>       /* max() */
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/types.h>
+#include <linux/errno.h>        /* error codes */
+#include <asm/system.h>         /* mb(), wmb() */
+#include <asm/atomic.h>
+
+#include <adlink_fifo.h>
+#include <adlink_txq.h>
+
+/*
+ * Any number of writers put frames into the queue concurrently, a single
+ * consumer at a time - whoever holds chip_lock - takes them out. Each cell
+ * carries a sequence number telling its state: equal to the position a
+ * producer may claim it at when free, one more when filled at that position.
+ * Producers claim a position by a compare and exchange on nEnqueue and
+ * publish the cell through its sequence number, so a writer preempted in
+ * between delays only the frames behind it, never the other writers.
+ */
+
+#if (WRITE_MESSAGE_COUNT & (WRITE_MESSAGE_COUNT - 1))
+#error "WRITE_MESSAGE_COUNT has to be a power of 2"
+#endif
+
+/* the cell belonging to a position */
+static inline TXQ_CELL *
+pcan_txq_cell (TX_QUEUE * q, u32 pos)
+{
+    return &q->cell[pos & (WRITE_MESSAGE_COUNT - 1)];
+}
+
+/* only allowed if neither producers nor the consumer are active */
+int
+pcan_txq_reset (TX_QUEUE * q)
+{
+    u32 i;
+
+    for (i = 0; i < WRITE_MESSAGE_COUNT; i++)
+        atomic_set (&q->cell[i].nSeq, i);
+
+    atomic_set (&q->nEnqueue, 0);
+    q->dwDequeue = 0;
+    q->dwTotal = 0;
+    mb ();
+
+    return 0;
+}
+
+/* discard all published frames, done on the consumer side */
+int
+pcan_txq_flush (TX_QUEUE * q)
+{
+    TX_IMAGE img;
+
+    while (!pcan_txq_get (q, &img))
+        ;
+
+    return 0;
+}
+
+/* append a frame, may be called by any number of writers at the same time */
+int
+pcan_txq_put (TX_QUEUE * q, TX_IMAGE * img)
+{
+    TXQ_CELL *cell;
+    u32 pos = atomic_read (&q->nEnqueue);
+    u32 old;
+    int diff;
+
+    for (;;)
+    {
+        cell = pcan_txq_cell (q, pos);
+        diff = (int) ((u32) atomic_read (&cell->nSeq) - pos);
+
+        if (!diff)
+        {
+            /* the cell is free at this position, try to claim it */
+            old = atomic_cmpxchg (&q->nEnqueue, pos, pos + 1);
+            if (old == pos)
+                break;
+            pos = old;
+        }
+        else if (diff < 0)
+            return -ENOSPC;     /* the consumer has not taken the frame a round before */
+        else
+            pos = atomic_read (&q->nEnqueue);   /* another writer was faster */
+    }
+
+    /* the consumer has left the cell before it handed it back */
+    mb ();
+
+    cell->img = *img;
+
+    /* publish the frame only when it is complete */
+    wmb ();
+    atomic_set (&cell->nSeq, pos + 1);
+
+    return 0;
+}
+
+/* take the oldest frame, only one consumer at a time */
+int
+pcan_txq_get (TX_QUEUE * q, TX_IMAGE * img)
+{
+    u32 pos = q->dwDequeue;
+    TXQ_CELL *cell = pcan_txq_cell (q, pos);
+
+    /* not yet published, even if a later position already is */
+    if (!pcan_txq_ready (q))
+        return -ENODATA;
+
+    /* read the frame not before the producer published it */
+    rmb ();
+
+    *img = cell->img;
+
+    /* hand the cell back only after it was copied */
+    mb ();
+    atomic_set (&cell->nSeq, pos + WRITE_MESSAGE_COUNT);
+    q->dwDequeue = pos + 1;
+    q->dwTotal++;
+
+    return 0;
+}
+
+/* the oldest frame if it is published, it stays in the queue; consumer only */
+TX_IMAGE *
+pcan_txq_peek (TX_QUEUE * q)
+{
+    if (!pcan_txq_ready (q))
+        return NULL;
+
+    rmb ();
+
+    return &pcan_txq_cell (q, q->dwDequeue)->img;
+}
+
+/* frames claimed by writers but not taken yet, including those still being written */
+int
+pcan_txq_status (TX_QUEUE * q)
+{
+    return (u32) atomic_read (&q->nEnqueue) - q->dwDequeue;
+}
+
+int
+pcan_txq_not_full (TX_QUEUE * q)
+{
+    return pcan_txq_status (q) < WRITE_MESSAGE_COUNT;
+}
+
+int
+pcan_txq_empty (TX_QUEUE * q)
+{
+    return !pcan_txq_status (q);
+}
+
+/* the oldest frame is published and can be taken by the consumer */
+int
+pcan_txq_ready (TX_QUEUE * q)
+{
+    u32 pos = q->dwDequeue;
+
+    return (u32) atomic_read (&pcan_txq_cell (q, pos)->nSeq) == pos + 1;
+}
+
+/*
+ * The transmit queues of a device, one per priority class. A frame aborted
+ * in the transmit buffer stays in txCurrent and is sent again before any
+ * other frame of its class. All but pcan_tx_pending() and pcan_tx_total()
+ * are for the consumer, who holds chip_lock.
+ *
+ * The head of a class may be held back by a shaper, a token bucket kept as
+ * the time it has no tokens until (generic cell rate algorithm), or by its
+ * launch time. Classes behind a held back one are served meanwhile, and
+ * tx_timer pushes the transmitter again when the first held back frame gets
+ * due. It fires launch_spin_ns early and spins the rest of the time outside
+ * chip_lock, to get clear of the timer's latency; the interrupt handler and
+ * the ioctls never spin, a frame not due yet has them arm tx_timer instead.
+ */
+
+/* the spinning is done in the timer handler, hence bounded */
+#define LAUNCH_SPIN_MAX_NS 50000
+
+static uint launch_spin_ns = 20000;
+module_param (launch_spin_ns, uint, 0444);
+MODULE_PARM_DESC (launch_spin_ns, "Time in nsec spent spinning before the launch time of a frame (at most 50000)");
+
+nanosecs_abs_t
+pcan_tx_launch_spin (void)
+{
+    return min_t (nanosecs_abs_t, launch_spin_ns, LAUNCH_SPIN_MAX_NS);
+}
+
+/* the shaper a frame is subject to, if any */
+static TX_SHAPER *
+pcan_tx_shaper (struct pcandev *dev, TX_IMAGE * img)
+{
+    TX_SHAPER *s;
+    u32 id = img->dwId & CAN_EFF_MASK;
+    int i;
+
+    for (i = 0; i < PCAN_TX_SHAPERS; i++)
+    {
+        s = &dev->txShaper[i];
+        if (s->dwIntervalNs && (s->ucClass == PCAN_TX_CLASSES || s->ucClass == img->ucClass) &&
+            (s->ucIdType == PCAN_SHAPE_ANY_ID ||
+             s->ucIdType == ((img->dwId & CAN_EFF_FLAG) ? PCAN_SHAPE_EXT_ID : PCAN_SHAPE_STD_ID)) &&
+            id >= s->dwFromID && id <= s->dwToID)
+            return s;
+    }
+
+    return NULL;
+}
+
+/* estimated length on the bus; a mailbox token costs what the latest frame written into its
+ * mailbox costs, which is not the frame the token was queued with if they were collapsed */
+static inline u16
+pcan_tx_bits (struct pcandev *dev, TX_IMAGE * img)
+{
+    if (!img->ucLen)
+        return ACCESS_ONCE (dev->txMailbox[img->ucImage[0]].img.wBits);
+
+    return img->wBits;
+}
+
+/* 0 if the frame may be sent now, the tokens are taken if bCharge is set;
+ * otherwise the time the frame gets due by its launch time or its shaper */
+static nanosecs_abs_t
+pcan_tx_shape (struct pcandev *dev, TX_IMAGE * img, nanosecs_abs_t now, int bCharge)
+{
+    TX_SHAPER *s;
+    nanosecs_abs_t base;
+    nanosecs_abs_t next;
+
+    /* not even the tokens are taken before the frame is due */
+    if (img->qwLaunch > now)
+        return img->qwLaunch;
+
+    if (!dev->ucShapers || !(s = pcan_tx_shaper (dev, img)))
+        return 0;
+
+    base = max (s->qwTat, now);
+    next = base + (nanosecs_abs_t) s->dwIntervalNs * ((s->ucUnit == PCAN_SHAPE_BITS) ? pcan_tx_bits (dev, img) : 1);
+
+    /* a full bucket lets any frame pass, even one costing more than the bucket holds */
+    if (base > now && next - now > s->qwTolerance)
+        return next - s->qwTolerance;
+
+    if (bCharge)
+        s->qwTat = next;
+
+    return 0;
+}
+
+/* the class whose head may be sent now, -1 if none; *due tells when a held back head gets due */
+static int
+pcan_tx_head (struct pcandev *dev, nanosecs_abs_t now, nanosecs_abs_t * due)
+{
+    TX_IMAGE *img;
+    nanosecs_abs_t t;
+    int c;
+
+    *due = 0;
+
+    for (c = 0; c < PCAN_TX_CLASSES; c++)
+    {
+        /* an aborted frame was charged already */
+        if (dev->ucTxState == TX_REQUEUED && dev->txCurrent.ucClass == c)
+            return c;
+
+        img = pcan_txq_peek (&dev->txq[c]);
+        if (!img)
+            continue;
+
+        t = pcan_tx_shape (dev, img, now, 0);
+        if (!t)
+            return c;
+
+        if (!*due || t < *due)
+            *due = t;
+    }
+
+    return -1;
+}
+
+/* have the transmitter pushed when a held back frame gets due */
+static void
+pcan_tx_arm (struct pcandev *dev, nanosecs_abs_t due)
+{
+    if (dev->qwTxTimerDue && dev->qwTxTimerDue <= due)
+        return;
+
+    /* reached from timer handlers, the interrupt handler and the ioctls alike, rtdm_timer_start()
+     * is right for all of them */
+    dev->qwTxTimerDue = due;
+    rtdm_timer_start (&dev->tx_timer, due - min (due, pcan_tx_launch_spin ()), 0,
+                      RTDM_TIMERMODE_ABSOLUTE);
+}
+
+/* only allowed if neither producers nor the consumer are active */
+void
+pcan_tx_reset (struct pcandev *dev)
+{
+    int c;
+
+    for (c = 0; c < PCAN_TX_CLASSES; c++)
+        pcan_txq_reset (&dev->txq[c]);
+
+    dev->ucTxState = TX_IDLE;
+
+    for (c = 0; c < TX_MAILBOXES; c++)
+        dev->txMailbox[c].ucPending = 0;
+
+    for (c = 0; c < PCAN_TX_SHAPERS; c++)
+        dev->txShaper[c].qwTat = 0;
+}
+
+/* discard all frames waiting for transmission */
+int
+pcan_tx_flush (struct pcandev *dev)
+{
+    int c;
+    rtdm_lockctx_t lockctx;
+
+    /* no token may be queued between emptying the queues and the mailboxes */
+    rtdm_lock_get_irqsave (&dev->mbox_lock, lockctx);
+
+    for (c = 0; c < PCAN_TX_CLASSES; c++)
+        pcan_txq_flush (&dev->txq[c]);
+
+    for (c = 0; c < TX_MAILBOXES; c++)
+        dev->txMailbox[c].ucPending = 0;
+
+    rtdm_lock_put_irqrestore (&dev->mbox_lock, lockctx);
+
+    if (dev->ucTxState == TX_REQUEUED)
+        dev->ucTxState = TX_IDLE;
+
+    return 0;
+}
+
+/* replace a token by the latest contents of its mailbox, which is free again afterwards */
+static void
+pcan_tx_mailbox_take (struct pcandev *dev, TX_IMAGE * img)
+{
+    TX_MAILBOX *m = &dev->txMailbox[img->ucImage[0]];
+    nanosecs_abs_t qwQueued = img->qwQueued;
+    nanosecs_abs_t qwLaunch = img->qwLaunch;
+    rtdm_lockctx_t lockctx;
+
+    rtdm_lock_get_irqsave (&dev->mbox_lock, lockctx);
+    *img = m->img;
+    m->ucPending = 0;
+    rtdm_lock_put_irqrestore (&dev->mbox_lock, lockctx);
+
+    /* the frame is timed by its first write */
+    img->qwQueued = qwQueued;
+    img->qwLaunch = qwLaunch;
+}
+
+/* queue a frame unless one of the same ID and class is still waiting, which gets its contents then;
+ * -ENOSPC if neither a mailbox nor a cell of the queue is free */
+int
+pcan_tx_put_latest (struct pcandev *dev, TX_IMAGE * img)
+{
+    TX_MAILBOX *m;
+    TX_IMAGE token;
+    rtdm_lockctx_t lockctx;
+    int free = -1;
+    int err;
+    int i;
+
+    rtdm_lock_get_irqsave (&dev->mbox_lock, lockctx);
+
+    for (i = 0; i < TX_MAILBOXES; i++)
+    {
+        m = &dev->txMailbox[i];
+
+        if (!m->ucPending)
+        {
+            if (free < 0)
+                free = i;
+            continue;
+        }
+
+        if (m->img.dwId == img->dwId && m->img.ucClass == img->ucClass)
+        {
+            /* payload and cost together, the queued token is shaped by the cost kept here */
+            m->img = *img;
+            dev->dwTxCollapsed++;
+            rtdm_lock_put_irqrestore (&dev->mbox_lock, lockctx);
+            return 0;
+        }
+    }
+
+    if (free < 0)
+    {
+        rtdm_lock_put_irqrestore (&dev->mbox_lock, lockctx);
+        return -ENOSPC;
+    }
+
+    m = &dev->txMailbox[free];
+    m->img = *img;
+
+    /* the token is shaped like the frame */
+    token = *img;
+    token.ucLen = 0;
+    token.ucImage[0] = (u8) free;
+
+    err = pcan_txq_put (&dev->txq[img->ucClass], &token);
+    if (!err)
+        m->ucPending = 1;
+
+    rtdm_lock_put_irqrestore (&dev->mbox_lock, lockctx);
+
+    return err;
+}
+
+/* take the frame to send next: the most urgent class first, an aborted frame ahead of its class;
+ * -EAGAIN if all waiting frames are held back by their shapers */
+int
+pcan_tx_get (struct pcandev *dev, TX_IMAGE * img)
+{
+    nanosecs_abs_t now = rtdm_clock_read ();
+    nanosecs_abs_t due;
+    int c;
+
+    c = pcan_tx_head (dev, now, &due);
+    if (c < 0)
+    {
+        if (!due)
+            return -ENODATA;
+
+        dev->dwTxShaped++;
+        pcan_tx_arm (dev, due);
+        return -EAGAIN;
+    }
+
+    if (dev->ucTxState == TX_REQUEUED && dev->txCurrent.ucClass == c)
+    {
+        *img = dev->txCurrent;
+        dev->ucTxState = TX_IDLE;
+        return 0;
+    }
+
+    pcan_txq_get (&dev->txq[c], img);
+    if (!img->ucLen)
+        pcan_tx_mailbox_take (dev, img);
+    pcan_tx_shape (dev, img, now, 1);
+
+    return 0;
+}
+
+/* charge a frame sent bypassing the queues, 0 if its shaper holds it back */
+int
+pcan_tx_admit (struct pcandev *dev, TX_IMAGE * img)
+{
+    if (!dev->ucShapers)
+        return 1;
+
+    return !pcan_tx_shape (dev, img, rtdm_clock_read (), 1);
+}
+
+/* change a shaper, the caller holds chip_lock */
+int
+pcan_tx_set_shaper (struct pcandev *dev, TPSHAPER * shaper)
+{
+    TX_SHAPER *s;
+    int i;
+
+    if (shaper->ucIndex >= PCAN_TX_SHAPERS || shaper->ucClass > PCAN_TX_CLASSES ||
+        shaper->ucUnit > PCAN_SHAPE_BITS || shaper->ucIdType > PCAN_SHAPE_EXT_ID ||
+        shaper->dwFromID > shaper->dwToID)
+        return -EINVAL;
+
+    /* a standard range beyond 11 bits, or a rate above a token per nsec, whose
+     * interval of 0 would disable the shaper */
+    if ((shaper->ucIdType == PCAN_SHAPE_STD_ID && shaper->dwToID > CAN_SFF_MASK) ||
+        shaper->dwRate > 1000000000U)
+        return -EINVAL;
+
+    s = &dev->txShaper[shaper->ucIndex];
+    s->ucClass = shaper->ucClass;
+    s->ucUnit = shaper->ucUnit;
+    s->ucIdType = shaper->ucIdType;
+    s->dwFromID = shaper->dwFromID;
+    s->dwToID = shaper->dwToID;
+    s->dwIntervalNs = (shaper->dwRate) ? 1000000000U / shaper->dwRate : 0;
+    s->qwTolerance = (nanosecs_abs_t) s->dwIntervalNs * shaper->dwBurst;
+    s->qwTat = 0;               /* start with a full bucket */
+
+    dev->ucShapers = 0;
+    for (i = 0; i < PCAN_TX_SHAPERS; i++)
+        if (dev->txShaper[i].dwIntervalNs)
+            dev->ucShapers++;
+
+    return 0;
+}
+
+/* frames waiting for transmission, including those still being written */
+int
+pcan_tx_pending (struct pcandev *dev)
+{
+    int c;
+    int n = (dev->ucTxState == TX_REQUEUED) ? 1 : 0;
+
+    for (c = 0; c < PCAN_TX_CLASSES; c++)
+        n += pcan_txq_status (&dev->txq[c]);
+
+    return n;
+}
+
+/* a frame can be taken by pcan_tx_get() now */
+int
+pcan_tx_ready (struct pcandev *dev)
+{
+    nanosecs_abs_t due;
+
+    return pcan_tx_head (dev, rtdm_clock_read (), &due) >= 0;
+}
+
+/* frames taken out of all queues */
+u32
+pcan_tx_total (struct pcandev *dev)
+{
+    int c;
+    u32 dwTotal = 0;
+
+    for (c = 0; c < PCAN_TX_CLASSES; c++)
+        dwTotal += dev->txq[c].dwTotal;
+
+    return dwTotal;
+}
+
+/* tell the readers of transmit reports the outcome of a frame, the caller holds chip_lock */
+void
+pcan_tx_report (struct pcandev *dev, TX_IMAGE * img, u8 ucResult, u8 ucArbitBit, u8 ucErrorCode)
+{
+    TPTXREPORT r;
+    canid_t id = img->dwId;
+
+    r.qwTimestamp = rtdm_clock_read ();
+    r.dwID = id & ((id & CAN_EFF_FLAG) ? CAN_EFF_MASK : CAN_SFF_MASK);
+    r.ucMsgType = ((id & CAN_EFF_FLAG) ? MSGTYPE_EXTENDED : 0) | ((id & CAN_RTR_FLAG) ? MSGTYPE_RTR : 0);
+    r.ucResult = ucResult;
+    r.ucArbitBit = ucArbitBit;
+    r.ucErrorCode = ucErrorCode;
+
+    if (pcan_fifo_put (&dev->reportFifo, &r))
+        dev->dwTxReportsLost++;
+    else
+        rtdm_event_signal (&dev->report_event);
+}
@@ -0,0 +1,44 @@
+#ifndef __PCAN_TXQ_H__
+#define __PCAN_TXQ_H__
+/* 
+ * Driver for dual-port isolated CAN interface card
+ * Copyright (C) 2011  Peter Kotvan <peter.kotvan@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <adlink_main.h>
+
+int pcan_txq_reset (TX_QUEUE * q);
+int pcan_txq_flush (TX_QUEUE * q);
+int pcan_txq_put (TX_QUEUE * q, TX_IMAGE * img);
+int pcan_txq_get (TX_QUEUE * q, TX_IMAGE * img);
+int pcan_txq_status (TX_QUEUE * q);
+int pcan_txq_not_full (TX_QUEUE * q);
+int pcan_txq_empty (TX_QUEUE * q);
+int pcan_txq_ready (TX_QUEUE * q);
+TX_IMAGE *pcan_txq_peek (TX_QUEUE * q);
+
+void pcan_tx_reset (struct pcandev *dev);
+int pcan_tx_flush (struct pcandev *dev);
+int pcan_tx_get (struct pcandev *dev, TX_IMAGE * img);
+int pcan_tx_put_latest (struct pcandev *dev, TX_IMAGE * img);
+void pcan_tx_report (struct pcandev *dev, TX_IMAGE * img, u8 ucResult, u8 ucArbitBit, u8 ucErrorCode);
+int pcan_tx_pending (struct pcandev *dev);
+int pcan_tx_ready (struct pcandev *dev);
+nanosecs_abs_t pcan_tx_launch_spin (void);
+int pcan_tx_admit (struct pcandev *dev, TX_IMAGE * img);
+int pcan_tx_set_shaper (struct pcandev *dev, TPSHAPER * shaper);
+u32 pcan_tx_total (struct pcandev *dev);
+
+#endif /* __PCAN_TXQ_H__ */
@@ -0,0 +1,293 @@
+/*
+ * Pcan communication driver
+ * Copyright (C) 2011  Peter Kotvan <peter.kotvan@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * can_bench - a measurement of one channel on its own, no other node needed.
+ *
+ * The channel runs in self test and self reception mode. First frames are sent one
+ * at a time for the round trip from the write ioctl to the receiving interrupt, then
+ * the same count back to back for the sustained frame rate. Each frame carries its
+ * sequence number in its data, a frame coming back late is never taken for the
+ * following one. The time spent in the interrupt handler meanwhile is taken from the
+ * counters of PCAN_GET_CHAN_STATS; its maximum is the one since the driver was loaded.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <rtdm/rtdm.h>
+
+#include <adlink.h>
+
+#define TIMEOUT_NS 100000000    /* a frame not back by then is lost */
+
+static int fd = -1;
+static unsigned int frames = 10000;     /* per phase */
+static __u32 id = 0x7e0;
+static __u16 btr0btr1 = 0x0014; /* 1 Mbit/s */
+
+/* frames taken back by the reader */
+static sem_t received;
+static volatile int round_trip;
+static volatile unsigned int rx_seq;
+static volatile unsigned int rx_count;
+static volatile __u64 rx_timestamp;
+
+static void
+usage (const char *name)
+{
+    fprintf (stderr, "usage: %s [-d minor] [-n frames] [-i id] [-b btr0btr1]\n", name);
+    exit (2);
+}
+
+/* the same clock as rtdm_clock_read() */
+static __u64
+now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+    return (__u64) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+deadline_in (struct timespec *ts, long ns)
+{
+    clock_gettime (CLOCK_REALTIME, ts);
+    ts->tv_nsec += ns;
+    if (ts->tv_nsec >= 1000000000)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+static void *
+reader (void *arg)
+{
+    TPCANRdMsgNs rmsg;
+    unsigned int seq;
+    int err;
+
+    /* runs until the path is closed */
+    while (!(err = rt_dev_ioctl (fd, PCAN_READ_MSG_NS, &rmsg)) || err == -EINTR)
+    {
+        if (err || (rmsg.Msg.MSGTYPE & (MSGTYPE_STATUS | MSGTYPE_EXTENDED)))
+            continue;
+        if (rmsg.Msg.ID != id || rmsg.Msg.LEN != 8)
+            continue;
+
+        memcpy (&seq, rmsg.Msg.DATA, sizeof (seq));
+        rx_timestamp = rmsg.qwTimestamp;
+        rx_seq = seq;
+        rx_count++;
+        if (round_trip)
+            sem_post (&received);
+    }
+
+    return NULL;
+}
+
+static int
+write_frame (unsigned int seq)
+{
+    TPCANWrMsg wmsg;
+    int err;
+
+    memset (&wmsg, 0, sizeof (wmsg));
+    wmsg.Msg.ID = id;
+    wmsg.Msg.MSGTYPE = MSGTYPE_STANDARD;
+    wmsg.Msg.LEN = 8;
+    wmsg.ucClass = PCAN_TX_NORMAL;
+    memcpy (wmsg.Msg.DATA, &seq, sizeof (seq));
+
+    while ((err = rt_dev_ioctl (fd, PCAN_WRITE_MSG_EX, &wmsg)) == -EINTR)
+        ;
+
+    return err;
+}
+
+/* one frame at a time, from the write ioctl to the receiving interrupt */
+static int
+phase_round_trip (void)
+{
+    struct timespec deadline;
+    unsigned int seq, n = 0;
+    __u64 t0, ns, total = 0, max = 0;
+
+    round_trip = 1;
+    for (seq = 0; seq < frames; seq++)
+    {
+        rx_seq = ~0U;
+        t0 = now_ns ();
+        if (write_frame (seq))
+            return -1;
+
+        deadline_in (&deadline, TIMEOUT_NS);
+        while (!sem_timedwait (&received, &deadline) || errno == EINTR)
+            if (rx_seq == seq)
+                break;
+        if (rx_seq != seq)
+            continue;           /* lost, not counted */
+
+        ns = rx_timestamp - t0;
+        total += ns;
+        if (ns > max)
+            max = ns;
+        n++;
+    }
+    round_trip = 0;
+
+    printf ("round trip: %u of %u frames back", n, frames);
+    if (n)
+        printf (", mean %llu ns, max %llu ns", total / n, max);
+    printf ("\n");
+
+    return 0;
+}
+
+/* back to back, the reader takes the frames meanwhile so the read fifo never overflows */
+static int
+phase_rate (void)
+{
+    struct timespec tick = { 0, 1000000 };
+    unsigned int seq, count0, n, last = 0;
+    __u64 t0, t1;
+    int idle_ms = 0;
+
+    count0 = rx_count;
+    t0 = now_ns ();
+    for (seq = 0; seq < frames; seq++)
+        if (write_frame (seq))
+            return -1;
+
+    /* wait for the rest, as long as frames keep coming */
+    while ((n = rx_count - count0) < frames && idle_ms < TIMEOUT_NS / 1000000)
+    {
+        nanosleep (&tick, NULL);
+        if (n == last)
+            idle_ms++;
+        else
+            idle_ms = 0;
+        last = n;
+    }
+    t1 = rx_timestamp;
+
+    printf ("back to back: %u of %u frames back", n, frames);
+    if (n && t1 > t0)
+        printf (", %llu frames/s", (__u64) n * 1000000000ULL / (t1 - t0));
+    printf ("\n");
+
+    return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+    pthread_t thread_read;
+    struct sched_param param = {.sched_priority = 50 };
+    pthread_attr_t attr;
+    TPCHANSTATS before, after;
+    TPCANInit init;
+    char name[16];
+    int minor = 0, opt, err;
+
+    while ((opt = getopt (argc, argv, "d:n:i:b:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            minor = atoi (optarg);
+            break;
+        case 'n':
+            frames = strtoul (optarg, NULL, 0);
+            break;
+        case 'i':
+            id = strtoul (optarg, NULL, 0);
+            break;
+        case 'b':
+            btr0btr1 = strtoul (optarg, NULL, 0);
+            break;
+        default:
+            usage (argv[0]);
+        }
+    }
+    if (!frames || id > 0x7ff)
+        usage (argv[0]);
+
+    mlockall (MCL_CURRENT | MCL_FUTURE);
+
+    snprintf (name, sizeof (name), "adlink%d", minor);
+    fd = rt_dev_open (name, 0);
+    if (fd < 0)
+    {
+        fprintf (stderr, "can't open %s (%d)\n", name, fd);
+        return 1;
+    }
+
+    memset (&init, 0, sizeof (init));
+    init.wBTR0BTR1 = btr0btr1;
+    init.ucCANMsgType = MSGTYPE_STANDARD;
+    init.ucListenOnly = PCAN_INIT_SELF_TEST | PCAN_INIT_SELF_RECEPTION;
+    if (rt_dev_ioctl (fd, PCAN_INIT, &init))
+    {
+        fprintf (stderr, "can't initialize %s\n", name);
+        return 1;
+    }
+
+    /* the reader outranks the writing main thread */
+    sem_init (&received, 0, 0);
+    pthread_attr_init (&attr);
+    pthread_attr_setinheritsched (&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy (&attr, SCHED_FIFO);
+    pthread_attr_setschedparam (&attr, &param);
+    pthread_create (&thread_read, &attr, reader, NULL);
+    pthread_attr_destroy (&attr);
+
+    param.sched_priority = 40;
+    pthread_setschedparam (pthread_self (), SCHED_FIFO, &param);
+
+    rt_dev_ioctl (fd, PCAN_GET_CHAN_STATS, &before);
+
+    err = phase_round_trip ();
+    if (!err)
+        err = phase_rate ();
+
+    rt_dev_ioctl (fd, PCAN_GET_CHAN_STATS, &after);
+
+    if (err)
+        fprintf (stderr, "write failed\n");
+    else if (after.dwIsrCount != before.dwIsrCount)
+        printf ("interrupt handler: %u runs, mean %llu ns, max %u ns since the driver was loaded\n",
+                after.dwIsrCount - before.dwIsrCount,
+                (after.qwIsrTotalNs - before.qwIsrTotalNs) / (after.dwIsrCount - before.dwIsrCount),
+                after.dwIsrMaxNs);
+
+    /* closing the path releases the reader */
+    rt_dev_close (fd);
+    pthread_join (thread_read, NULL);
+
+    return err ? 1 : 0;
+}
@@ -0,0 +1,301 @@
+/*
+ * Pcan communication driver
+ * Copyright (C) 2011  Peter Kotvan <peter.kotvan@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * tx_latency - time from the write ioctl to the transmission request, with the
+ * transmitter loaded by the write ioctl itself (direct_write=1) against the frame
+ * always taking the way through the transmit queue (direct_write=0).
+ *
+ * The channel runs in self test and self reception mode. Frames are written one at
+ * a time to an idle transmitter, each numbered in its data, and taken back before the
+ * next one is written. For both settings of direct_write the program reports the
+ * driver's own figure, the mean time from the write ioctl to the transmission request
+ * out of PCAN_GET_CHAN_STATS, and the time from the write to the start of frame as
+ * seen by the receiving side. The module parameter is switched through sysfs, which
+ * needs root, and is restored at the end.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <rtdm/rtdm.h>
+
+#include <adlink.h>
+
+#define DIRECT_WRITE "/sys/module/adlink/parameters/direct_write"
+#define FRAME_ID     0x123
+#define TIMEOUT_NS   100000000  /* a frame not back by then is lost */
+
+static int fd = -1;
+static unsigned int frames = 10000;     /* per phase */
+static __u16 btr0btr1 = 0x0014; /* 1 Mbit/s */
+
+/* the last frame taken back by the reader */
+static sem_t received;
+static volatile unsigned int rx_seq;
+static volatile __u64 rx_sof;
+
+static void
+usage (const char *name)
+{
+    fprintf (stderr, "usage: %s [-d minor] [-n frames] [-b btr0btr1]\n", name);
+    exit (2);
+}
+
+/* the same clock as rtdm_clock_read() */
+static __u64
+now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+    return (__u64) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+direct_write_get (void)
+{
+    FILE *f = fopen (DIRECT_WRITE, "r");
+    int value = -1;
+
+    if (f)
+    {
+        if (fscanf (f, "%d", &value) != 1)
+            value = -1;
+        fclose (f);
+    }
+
+    return value;
+}
+
+static int
+direct_write_set (int value)
+{
+    FILE *f = fopen (DIRECT_WRITE, "w");
+
+    if (!f)
+        return -1;
+    fprintf (f, "%d\n", value);
+
+    return fclose (f);
+}
+
+static void *
+reader (void *arg)
+{
+    TPCANRdMsgNs rmsg;
+    unsigned int seq;
+    int err;
+
+    /* runs until the path is closed */
+    while (!(err = rt_dev_ioctl (fd, PCAN_READ_MSG_NS, &rmsg)) || err == -EINTR)
+    {
+        if (err || (rmsg.Msg.MSGTYPE & MSGTYPE_STATUS))
+            continue;
+        if (rmsg.Msg.ID != FRAME_ID || rmsg.Msg.LEN != 4)
+            continue;
+
+        memcpy (&seq, rmsg.Msg.DATA, sizeof (seq));
+        rx_sof = rmsg.qwSofTimestamp;
+        rx_seq = seq;
+        sem_post (&received);
+    }
+
+    return NULL;
+}
+
+static int
+compare (const void *a, const void *b)
+{
+    __u32 x = *(const __u32 *) a;
+    __u32 y = *(const __u32 *) b;
+
+    return (x > y) - (x < y);
+}
+
+/* frames one at a time, returns the number lost */
+static unsigned int
+phase (int direct, __u32 * samples)
+{
+    TPCANWrMsg wmsg;
+    TPCHANSTATS before, after;
+    struct timespec deadline;
+    unsigned int seq, lost = 0, n = 0;
+    __u64 t0, total = 0;
+    __u32 dwRequests;
+
+    memset (&wmsg, 0, sizeof (wmsg));
+    wmsg.Msg.ID = FRAME_ID;
+    wmsg.Msg.MSGTYPE = MSGTYPE_STANDARD;
+    wmsg.Msg.LEN = 4;
+    wmsg.ucClass = PCAN_TX_NORMAL;
+
+    rt_dev_ioctl (fd, PCAN_GET_CHAN_STATS, &before);
+
+    for (seq = 0; seq < frames; seq++)
+    {
+        memcpy (wmsg.Msg.DATA, &seq, sizeof (seq));
+        rx_seq = ~0U;
+
+        t0 = now_ns ();
+        if (rt_dev_ioctl (fd, PCAN_WRITE_MSG_EX, &wmsg))
+        {
+            lost++;
+            continue;
+        }
+
+        /* a late frame of an earlier round is skipped, the sequence number tells */
+        clock_gettime (CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += TIMEOUT_NS;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (!sem_timedwait (&received, &deadline) || errno == EINTR)
+            if (rx_seq == seq)
+                break;
+        if (rx_seq != seq)
+        {
+            lost++;
+            continue;
+        }
+
+        samples[n++] = (__u32) (rx_sof - t0);
+        total += rx_sof - t0;
+    }
+
+    rt_dev_ioctl (fd, PCAN_GET_CHAN_STATS, &after);
+
+    /* the driver keeps a mean since it was loaded, the mean of this phase is taken out of it */
+    dwRequests = after.dwTxRequests - before.dwTxRequests;
+    printf ("direct_write=%d: %u frames, %u written directly, %u lost\n", direct, frames,
+            after.dwTxDirect - before.dwTxDirect, lost);
+    if (dwRequests)
+        printf ("  write ioctl to transmission request: mean %llu ns (driver)\n",
+                ((__u64) after.dwTxLatencyAvgNs * after.dwTxRequests -
+                 (__u64) before.dwTxLatencyAvgNs * before.dwTxRequests) / dwRequests);
+    if (n)
+    {
+        qsort (samples, n, sizeof (*samples), compare);
+        printf ("  write ioctl to start of frame: mean %llu ns, median %u ns, 99%% %u ns, max %u ns\n",
+                total / n, samples[n / 2], samples[(n * 99) / 100], samples[n - 1]);
+    }
+
+    return lost;
+}
+
+int
+main (int argc, char *argv[])
+{
+    pthread_t thread_read;
+    struct sched_param param = {.sched_priority = 50 };
+    pthread_attr_t attr;
+    TPCANInit init;
+    char name[16];
+    __u32 *samples;
+    int minor = 0, saved, opt;
+    unsigned int lost;
+
+    while ((opt = getopt (argc, argv, "d:n:b:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            minor = atoi (optarg);
+            break;
+        case 'n':
+            frames = strtoul (optarg, NULL, 0);
+            break;
+        case 'b':
+            btr0btr1 = strtoul (optarg, NULL, 0);
+            break;
+        default:
+            usage (argv[0]);
+        }
+    }
+    if (!frames)
+        usage (argv[0]);
+
+    if ((saved = direct_write_get ()) < 0)
+    {
+        fprintf (stderr, "can't read %s\n", DIRECT_WRITE);
+        return 1;
+    }
+    if (!(samples = malloc (frames * sizeof (*samples))))
+        return 1;
+
+    mlockall (MCL_CURRENT | MCL_FUTURE);
+
+    snprintf (name, sizeof (name), "adlink%d", minor);
+    fd = rt_dev_open (name, 0);
+    if (fd < 0)
+    {
+        fprintf (stderr, "can't open %s (%d)\n", name, fd);
+        return 1;
+    }
+
+    memset (&init, 0, sizeof (init));
+    init.wBTR0BTR1 = btr0btr1;
+    init.ucCANMsgType = MSGTYPE_STANDARD;
+    init.ucListenOnly = PCAN_INIT_SELF_TEST | PCAN_INIT_SELF_RECEPTION;
+    if (rt_dev_ioctl (fd, PCAN_INIT, &init))
+    {
+        fprintf (stderr, "can't initialize %s\n", name);
+        return 1;
+    }
+
+    /* the reader outranks the writing main thread */
+    sem_init (&received, 0, 0);
+    pthread_attr_init (&attr);
+    pthread_attr_setinheritsched (&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy (&attr, SCHED_FIFO);
+    pthread_attr_setschedparam (&attr, &param);
+    pthread_create (&thread_read, &attr, reader, NULL);
+    pthread_attr_destroy (&attr);
+
+    param.sched_priority = 40;
+    pthread_setschedparam (pthread_self (), SCHED_FIFO, &param);
+
+    if (direct_write_set (0))
+    {
+        fprintf (stderr, "can't write %s\n", DIRECT_WRITE);
+        lost = 1;
+    }
+    else
+    {
+        lost = phase (0, samples);
+        direct_write_set (1);
+        lost += phase (1, samples);
+        direct_write_set (saved);
+    }
+
+    /* closing the path releases the reader */
+    rt_dev_close (fd);
+    pthread_join (thread_read, NULL);
+    free (samples);
+
+    return lost ? 1 : 0;
+}
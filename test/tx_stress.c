@@ -0,0 +1,338 @@
+/*
+ * Pcan communication driver
+ * Copyright (C) 2011  Peter Kotvan <peter.kotvan@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * tx_stress - hammers the transmit path of one channel and checks that no frame and
+ * no release of the transmitter (DataSendReady) gets lost.
+ *
+ * The channel runs in self test and self reception mode, so a bus without another
+ * node will do. Several writers send numbered frames of an identifier of their own,
+ * spread over the transmit classes so that urgent frames abort the others, while one
+ * reader takes the frames back. Optionally the channel is reconfigured all the time,
+ * which cuts frames off in the transmit buffer.
+ *
+ * A lost wakeup leaves writers blocked on a full queue or frames unsent with the
+ * transmitter idle; either stops the progress and is reported as a stall. Load the
+ * driver with tx_watchdog=0, otherwise the watchdog covers up a lost release; one it
+ * had to recover from is counted as a failure too.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <rtdm/rtdm.h>
+
+#include <adlink.h>
+
+#define WRITERS_MAX  16
+#define WRITER_ID    0x100      /* identifier of the first writer */
+
+static int fd_read = -1;
+static int fd_write[WRITERS_MAX];
+static int writers = 4;
+static unsigned int frames = 100000;    /* per writer */
+static int reconfigure = 0;
+static int stall_ms = 1000;
+static __u16 btr0btr1 = 0x0014; /* 1 Mbit/s */
+
+static volatile unsigned int sent[WRITERS_MAX];
+static volatile unsigned int received[WRITERS_MAX];
+static volatile unsigned int errors;
+static volatile int done;
+
+static void
+usage (const char *name)
+{
+    fprintf (stderr, "usage: %s [-d minor] [-w writers] [-n frames] [-b btr0btr1] [-s stall_ms] [-r]\n",
+             name);
+    exit (2);
+}
+
+static int
+init (int fd, __u8 ucListenOnly)
+{
+    TPCANInit init;
+
+    memset (&init, 0, sizeof (init));
+    init.wBTR0BTR1 = btr0btr1;
+    init.ucCANMsgType = MSGTYPE_STANDARD;
+    init.ucListenOnly = ucListenOnly;
+
+    return rt_dev_ioctl (fd, PCAN_INIT, &init);
+}
+
+static void *
+writer (void *arg)
+{
+    int n = (int) (long) arg;
+    TPCANWrMsg wmsg;
+    unsigned int seq;
+    int err;
+
+    memset (&wmsg, 0, sizeof (wmsg));
+    wmsg.Msg.ID = WRITER_ID + n;
+    wmsg.Msg.MSGTYPE = MSGTYPE_STANDARD;
+    wmsg.Msg.LEN = 4;
+    wmsg.ucClass = n % PCAN_TX_CLASSES;
+
+    for (seq = 0; seq < frames; seq++)
+    {
+        memcpy (wmsg.Msg.DATA, &seq, sizeof (seq));
+
+        /* a full queue makes the write wait for the transmitter */
+        while ((err = rt_dev_ioctl (fd_write[n], PCAN_WRITE_MSG_EX, &wmsg)) == -EINTR)
+            ;
+        if (err)
+        {
+            fprintf (stderr, "writer %d: write of frame %u failed (%d)\n", n, seq, err);
+            errors++;
+            break;
+        }
+        sent[n] = seq + 1;
+    }
+
+    return NULL;
+}
+
+static void *
+reader (void *arg)
+{
+    TPCANRdMsgNs rmsg;
+    unsigned int seq;
+    int n, err;
+
+    while (!done)
+    {
+        err = rt_dev_ioctl (fd_read, PCAN_READ_MSG_NS, &rmsg);
+        if (err == -EINTR)
+            continue;
+        if (err)
+        {
+            fprintf (stderr, "reader: read failed (%d)\n", err);
+            errors++;
+            break;
+        }
+
+        /* status messages of the reconfiguration */
+        if (rmsg.Msg.MSGTYPE & MSGTYPE_STATUS)
+            continue;
+
+        n = rmsg.Msg.ID - WRITER_ID;
+        if (n < 0 || n >= writers || rmsg.Msg.LEN != 4)
+        {
+            fprintf (stderr, "reader: unexpected frame 0x%x\n", rmsg.Msg.ID);
+            errors++;
+            continue;
+        }
+
+        /* a class keeps the order, a frame cut off is sent again before the next */
+        memcpy (&seq, rmsg.Msg.DATA, sizeof (seq));
+        if (seq != received[n])
+        {
+            fprintf (stderr, "reader: writer %d frame %u, %u expected\n", n, seq, received[n]);
+            errors++;
+            if (seq < received[n])
+                continue;
+        }
+        received[n] = seq + 1;
+    }
+
+    return NULL;
+}
+
+static void *
+reconfigurer (void *arg)
+{
+    struct timespec ts = { 0, 2000000 };
+    __u8 mode = PCAN_INIT_SELF_TEST | PCAN_INIT_SELF_RECEPTION;
+    int i = 0;
+
+    /* toggling the error reports makes each PCAN_INIT pass through reset mode */
+    while (!done)
+    {
+        if (init (fd_read, mode | ((i++ & 1) ? PCAN_INIT_ERROR_REPORTS : 0)))
+            errors++;
+        nanosleep (&ts, NULL);
+    }
+
+    return NULL;
+}
+
+static int
+start (pthread_t * thread, void *(*fn) (void *), void *arg, int prio)
+{
+    struct sched_param param = {.sched_priority = prio };
+    pthread_attr_t attr;
+    int err;
+
+    pthread_attr_init (&attr);
+    pthread_attr_setinheritsched (&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy (&attr, SCHED_FIFO);
+    pthread_attr_setschedparam (&attr, &param);
+    err = pthread_create (thread, &attr, fn, arg);
+    pthread_attr_destroy (&attr);
+
+    return err;
+}
+
+static unsigned int
+total (volatile unsigned int *count)
+{
+    unsigned int sum = 0;
+    int n;
+
+    for (n = 0; n < writers; n++)
+        sum += count[n];
+
+    return sum;
+}
+
+int
+main (int argc, char *argv[])
+{
+    pthread_t thread_read, thread_reconf, thread_write[WRITERS_MAX];
+    struct timespec tick = { 0, 100000000 };
+    TPCHANSTATS stats0, stats;
+    TPEXTENDEDSTATUS status;
+    char name[16];
+    unsigned int progress = 0, now;
+    int minor = 0, idle_ms = 0, result = 0;
+    int opt, n;
+
+    while ((opt = getopt (argc, argv, "d:w:n:b:s:r")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            minor = atoi (optarg);
+            break;
+        case 'w':
+            writers = atoi (optarg);
+            break;
+        case 'n':
+            frames = strtoul (optarg, NULL, 0);
+            break;
+        case 'b':
+            btr0btr1 = strtoul (optarg, NULL, 0);
+            break;
+        case 's':
+            stall_ms = atoi (optarg);
+            break;
+        case 'r':
+            reconfigure = 1;
+            break;
+        default:
+            usage (argv[0]);
+        }
+    }
+    if (writers < 1 || writers > WRITERS_MAX || !frames || stall_ms <= 0)
+        usage (argv[0]);
+
+    mlockall (MCL_CURRENT | MCL_FUTURE);
+
+    snprintf (name, sizeof (name), "adlink%d", minor);
+    fd_read = rt_dev_open (name, 0);
+    if (fd_read < 0)
+    {
+        fprintf (stderr, "can't open %s (%d)\n", name, fd_read);
+        return 1;
+    }
+    if (init (fd_read, PCAN_INIT_SELF_TEST | PCAN_INIT_SELF_RECEPTION))
+    {
+        fprintf (stderr, "can't initialize %s\n", name);
+        return 1;
+    }
+    for (n = 0; n < writers; n++)
+    {
+        fd_write[n] = rt_dev_open (name, 0);
+        if (fd_write[n] < 0)
+        {
+            fprintf (stderr, "can't open %s for writer %d (%d)\n", name, n, fd_write[n]);
+            return 1;
+        }
+    }
+    rt_dev_ioctl (fd_read, PCAN_GET_CHAN_STATS, &stats0);
+
+    /* the reader outranks the writers, a full read queue would lose frames */
+    start (&thread_read, reader, NULL, 60);
+    if (reconfigure)
+        start (&thread_reconf, reconfigurer, NULL, 55);
+    for (n = 0; n < writers; n++)
+        start (&thread_write[n], writer, (void *) (long) n, 50);
+
+    /* progress is frames written plus frames received, nothing may stop it for long */
+    while (total (received) < writers * frames && !errors)
+    {
+        nanosleep (&tick, NULL);
+        now = total (sent) + total (received);
+        if (now != progress)
+        {
+            progress = now;
+            idle_ms = 0;
+        }
+        else if ((idle_ms += 100) >= stall_ms)
+            break;
+    }
+    done = 1;
+
+    rt_dev_ioctl (fd_read, PCAN_GET_EXT_STATUS, &status);
+    rt_dev_ioctl (fd_read, PCAN_GET_CHAN_STATS, &stats);
+
+    printf ("frames written %u, received %u of %u, pending writes %d\n",
+            total (sent), total (received), writers * frames, status.nPendingWrites);
+    printf ("transmission requests %u, aborts %u, stall recoveries %u\n",
+            stats.dwTxRequests - stats0.dwTxRequests, stats.dwTxAborts - stats0.dwTxAborts,
+            stats.dwTxStallRecoveries - stats0.dwTxStallRecoveries);
+
+    if (total (received) < writers * frames)
+    {
+        fprintf (stderr, "FAIL: no progress for %d ms\n", stall_ms);
+        result = 1;
+    }
+    /* the transmitter not handed back counts as a pending write */
+    if (status.nPendingWrites)
+    {
+        fprintf (stderr, "FAIL: the transmitter was not released\n");
+        result = 1;
+    }
+    if (stats.dwTxStallRecoveries != stats0.dwTxStallRecoveries)
+    {
+        fprintf (stderr, "FAIL: the transmit watchdog had to recover the transmitter\n");
+        result = 1;
+    }
+    if (errors)
+    {
+        fprintf (stderr, "FAIL: %u errors\n", errors);
+        result = 1;
+    }
+    if (!result)
+        printf ("PASS\n");
+
+    /* closing the paths releases threads still blocked in the driver */
+    for (n = 0; n < writers; n++)
+        rt_dev_close (fd_write[n]);
+    rt_dev_close (fd_read);
+
+    return result;
+}